@@ -1,103 +1,1822 @@
 #include <iostream>
 #include <thread>
 #include <vector>
+#include <array>
 #include <future>
 #include <algorithm>
 #include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <random>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include <cmath>
+#include <ctime>
+#include <utility>
+#include <atomic>
+#include <memory>
+#ifdef __linux__
+#include <unistd.h> // sysconf, gethostname
+#include <sys/utsname.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sched.h> // sched_getaffinity
+#include <linux/mempolicy.h> // MPOL_*, for raw mbind() so that we don't need libnuma
+#endif
+#ifdef _MSC_VER
+#include <malloc.h> // _aligned_malloc
+#define NOMINMAX // keep std::min & max usable
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h> // SetThreadAffinityMask
+#endif
+
+#include "perf_counters.h" // from ../src
+#include "cache_aligned.h" // cacheLineSize
 
 using namespace std;
 
-// returns totalFlopCount
-int memBandwithWaster(vector<float>& workArea, chrono::steady_clock::time_point tEnd) {
-  const auto workAreaSize = workArea.size();
-  int loopCount = 0;
-  while (chrono::steady_clock::now() < tEnd) {
-    for (unsigned int i=0; i<workAreaSize; ++i)
-      ++workArea[i]; // this here is the 'work' being done
-    ++loopCount;
+// STREAM-style kernels, see https://www.cs.virginia.edu/stream/ref.html
+// The original ++workArea[i] loop is kept as 'increment'.
+enum class Kernel { Increment, Copy, Scale, Add, Triad, ReadOnly, WriteOnly };
+
+struct KernelInfo {
+  Kernel kernel;
+  const char* name;
+  int arrays; // bitmask of the a, b, c arrays (of workAreaSize floats each) the kernel touches
+  int bytesPerElem; // bytes moved per elem as counted by STREAM, so ignoring write-allocate traffic
+};
+
+const KernelInfo kernelInfos[] = {
+  { Kernel::Increment, "increment", 1,     2 * sizeof(float) }, // a[i] = a[i] + 1
+  { Kernel::Copy,      "copy",      1|4,   2 * sizeof(float) }, // c[i] = a[i]
+  { Kernel::Scale,     "scale",     2|4,   2 * sizeof(float) }, // b[i] = s * c[i]
+  { Kernel::Add,       "add",       1|2|4, 3 * sizeof(float) }, // c[i] = a[i] + b[i]
+  { Kernel::Triad,     "triad",     1|2|4, 3 * sizeof(float) }, // a[i] = b[i] + s * c[i]
+  { Kernel::ReadOnly,  "read",      1,     1 * sizeof(float) }, // sum += a[i]
+  { Kernel::WriteOnly, "write",     1,     1 * sizeof(float) }, // a[i] = s
+};
+
+const KernelInfo* findKernel(const string& name) {
+  for (const auto& info : kernelInfos)
+    if (name == info.name)
+      return &info;
+  return nullptr;
+}
+
+// Human-readable progress output. Goes to stderr when stdout carries the
+// json or csv results instead.
+ostream* progressStream = &cout;
+ostream& progress() { return *progressStream; }
+
+// --perf: read hw counters around each measured region
+bool perfEnabled = false;
+
+// counters for the calling thread if --perf, else null
+unique_ptr<PerfCounters> openPerfCounters() {
+  return unique_ptr<PerfCounters>(perfEnabled ? new PerfCounters : nullptr);
+}
+
+// How often each configuration gets measured. Warm-up runs are thrown away.
+struct Sampling {
+  int warmup = 0;
+  int repeat = 1;
+  int durationMs = 1000; // per bandwidth run
+};
+
+struct Stats {
+  vector<double> samples;
+  double min = 0, median = 0, max = 0, mean = 0, stddev = 0; // stddev is the sample stddev
+};
+
+Stats computeStats(const vector<double>& samples) {
+  Stats stats;
+  stats.samples = samples;
+  if (samples.empty())
+    return stats;
+  vector<double> sorted = samples;
+  sort(sorted.begin(), sorted.end());
+  const size_t n = sorted.size();
+  stats.min = sorted.front();
+  stats.max = sorted.back();
+  stats.median = n % 2 == 1 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+  for (double x : sorted)
+    stats.mean += x / n;
+  if (n > 1) {
+    double sumSq = 0;
+    for (double x : sorted)
+      sumSq += (x - stats.mean) * (x - stats.mean);
+    stats.stddev = sqrt(sumSq / (n - 1));
+  }
+  return stats;
+}
+
+// runs runOnce() sampling.warmup times discarding the results, then
+// sampling.repeat times
+template <class Func>
+Stats repeatRun(const Sampling& sampling, Func runOnce) {
+  for (int i=0; i<sampling.warmup; ++i)
+    runOnce();
+  vector<double> samples;
+  for (int i=0; i<sampling.repeat; ++i)
+    samples.push_back(runOnce());
+  Stats stats = computeStats(samples);
+  if (samples.size() > 1)
+    progress() << "  => median=" << stats.median << " min=" << stats.min << " max=" << stats.max
+               << " stddev=" << stats.stddev << " over " << samples.size() << " runs\n";
+  return stats;
+}
+
+// one line of the json/csv output
+struct Record {
+  string mode; // bandwidth, latency or numa-matrix
+  string kernel;
+  string isa; // see isaInfos
+  bool nonTemporal = false; // streaming stores
+  uint64_t prefetchBytes = 0; // software prefetch distance, 0 for none
+  int threads;
+  uint64_t bytesPerThread;
+  string placement;
+  string pages = "default"; // see pagesInfos
+  string unit;
+  Stats stats;
+  double timerOverheadPct = 0; // share of the timed loop spent reading the clock, worst run
+  PerfCounts perf; // of the last run, summed over threads, only with --perf
+};
+
+// NUMA topology as listed in /sys/devices/system/node, restricted to the
+// cpus this process may run on (taskset, cgroup cpuset), since pinning to
+// any other cpu fails. On non-Linux boxes (or without sysfs) this is a
+// single node holding all CPUs.
+struct NumaTopology {
+  vector<int> nodes; // node ids, not necessarily contiguous
+  vector<vector<int>> nodeCpus; // cpus of nodes[i], empty for memory-only nodes
+
+  int nodeOfCpu(int cpu) const {
+    for (size_t i=0; i<nodes.size(); ++i)
+      if (find(nodeCpus[i].begin(), nodeCpus[i].end(), cpu) != nodeCpus[i].end())
+        return nodes[i];
+    return nodes.front();
+  }
+
+  vector<int> allCpus() const {
+    vector<int> cpus;
+    for (const auto& c : nodeCpus)
+      cpus.insert(cpus.end(), c.begin(), c.end());
+    sort(cpus.begin(), cpus.end());
+    return cpus;
+  }
+};
+
+// parses sysfs cpu/node lists like '0-3,8-11'
+vector<int> parseIdList(const string& list) {
+  vector<int> ids;
+  stringstream ss(list);
+  string range;
+  while (getline(ss, range, ',')) {
+    if (range.empty() || range == "\n")
+      continue;
+    auto dash = range.find('-');
+    int first = stoi(range.substr(0, dash));
+    int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+    for (int id=first; id<=last; ++id)
+      ids.push_back(id);
+  }
+  return ids;
+}
+
+// the process affinity mask, empty if unknown
+vector<int> allowedCpus() {
+  vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  if (sched_getaffinity(0, sizeof(cpuSet), &cpuSet) == 0)
+    for (int cpu=0; cpu<CPU_SETSIZE; ++cpu)
+      if (CPU_ISSET(cpu, &cpuSet))
+        cpus.push_back(cpu);
+#elif defined(_MSC_VER)
+  DWORD_PTR processMask, systemMask;
+  if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+    for (int cpu=0; cpu<int(8 * sizeof(DWORD_PTR)); ++cpu)
+      if ((processMask >> cpu) & 1)
+        cpus.push_back(cpu);
+#endif
+  return cpus;
+}
+
+NumaTopology readNumaTopology() {
+  NumaTopology topology;
+  const vector<int> allowed = allowedCpus();
+  auto isAllowed = [&allowed](int cpu) {
+    return allowed.empty() || find(allowed.begin(), allowed.end(), cpu) != allowed.end();
+  };
+  string line;
+  ifstream online("/sys/devices/system/node/online");
+  if (getline(online, line)) {
+    for (int node : parseIdList(line)) {
+      ifstream cpulist("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+      string cpus;
+      getline(cpulist, cpus);
+      topology.nodes.push_back(node);
+      topology.nodeCpus.push_back(vector<int>());
+      for (int cpu : parseIdList(cpus))
+        if (isAllowed(cpu))
+          topology.nodeCpus.back().push_back(cpu);
+    }
+  }
+  if (topology.allCpus().empty()) { // no sysfs, or it disagrees with the affinity mask
+    topology.nodes.assign(1, 0);
+    topology.nodeCpus.assign(1, allowed);
+    if (allowed.empty())
+      for (int cpu=0, n=max(1u, thread::hardware_concurrency()); cpu<n; ++cpu)
+        topology.nodeCpus.back().push_back(cpu);
+  }
+  return topology;
+}
+
+// pins the calling thread to a single cpu, throws where that's unsupported
+// rather than silently reporting unpinned runs as pinned
+void pinThisThread(int cpu) {
+#ifdef __linux__
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  CPU_SET(cpu, &cpuSet);
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+  if (err != 0)
+    throw runtime_error("pthread_setaffinity_np failed for cpu " + to_string(cpu));
+#elif defined(_MSC_VER)
+  // only the calling thread's processor group, i.e. the first 64 cpus
+  if (cpu >= int(8 * sizeof(DWORD_PTR)) || SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) == 0)
+    throw runtime_error("SetThreadAffinityMask failed for cpu " + to_string(cpu));
+#else
+  throw runtime_error("pinning to cpu " + to_string(cpu) + " is only supported on Linux and Windows");
+#endif
+}
+
+// Where the work area pages end up. FirstTouch is the OS default (the node
+// of whichever thread writes a page first), the others bind via mbind().
+enum class MemPolicy { FirstTouch, Local, Remote, Interleave, Node };
+
+// Page size backing the work areas. Default is whatever the kernel does,
+// which includes transparent huge pages if THP is set to 'always'. Small
+// forces 4 KiB pages via MADV_NOHUGEPAGE, Thp asks for them via
+// MADV_HUGEPAGE, and Huge2M/Huge1G map explicit hugetlbfs pages, which need
+// to be reserved up front, e.g. via /proc/sys/vm/nr_hugepages.
+enum class Pages { Default, Small, Thp, Huge2M, Huge1G };
+
+struct PagesInfo {
+  Pages pages;
+  const char* name;
+};
+
+const PagesInfo pagesInfos[] = {
+  { Pages::Default, "default" },
+  { Pages::Small, "4k" },
+  { Pages::Thp, "thp" },
+  { Pages::Huge2M, "2m" },
+  { Pages::Huge1G, "1g" },
+};
+
+const char* pagesName(Pages pages) {
+  for (const auto& info : pagesInfos)
+    if (info.pages == pages)
+      return info.name;
+  return "?";
+}
+
+struct Placement {
+  bool pinThreads = false; // pin worker i to cpus[i % cpus.size()]
+  bool workerFirstTouch = false; // worker allocates & inits its own work areas
+  MemPolicy memPolicy = MemPolicy::FirstTouch;
+  vector<int> cpus; // cpus to pin to, all cpus if empty
+  int memNode = 0; // for MemPolicy::Node
+  Pages pages = Pages::Default;
+};
+
+// Page-aligned memory. A vector can't be mbind()ed or madvise()d before its
+// pages get touched, so the work areas and the latency buffer use this.
+class Mapping {
+  public:
+    Mapping() : mapped_(nullptr), mappedBytes_(0), data_(nullptr) {}
+    ~Mapping() { release(); }
+
+    // memNodes: nodes to bind to, interleaved if more than one, empty for
+    // first touch. Pages are not touched here.
+    void map(size_t bytes, Pages pages, const vector<int>& memNodes) {
+      release();
+      bytes = max<size_t>(bytes, 1);
+#ifdef __linux__
+      const size_t hugePageBytes = pages == Pages::Huge1G ? size_t(1) << 30 : size_t(2) << 20;
+      int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+      size_t alignment = 4096;
+      if (pages == Pages::Huge2M || pages == Pages::Huge1G) {
+        flags |= MAP_HUGETLB | ((pages == Pages::Huge1G ? 30 : 21) << MAP_HUGE_SHIFT);
+        bytes = (bytes + hugePageBytes - 1) / hugePageBytes * hugePageBytes;
+      }
+      else if (pages == Pages::Thp) {
+        // THP only backs 2 MiB aligned ranges, so align by over-allocating
+        alignment = hugePageBytes;
+        bytes = (bytes + hugePageBytes - 1) / hugePageBytes * hugePageBytes;
+      }
+      mappedBytes_ = bytes + (alignment > 4096 ? alignment : 0);
+      mapped_ = mmap(nullptr, mappedBytes_, PROT_READ | PROT_WRITE, flags, -1, 0);
+      if (mapped_ == MAP_FAILED) {
+        mapped_ = nullptr;
+        throw runtime_error("mmap failed for " + to_string(bytes) + " bytes of " + pagesName(pages) + " pages"
+          + ((flags & MAP_HUGETLB) != 0 ? ", are enough huge pages reserved?" : ""));
+      }
+      uintptr_t addr = reinterpret_cast<uintptr_t>(mapped_);
+      data_ = reinterpret_cast<void*>((addr + alignment - 1) / alignment * alignment);
+
+      if (pages == Pages::Thp && madvise(data_, bytes, MADV_HUGEPAGE) != 0)
+        throw runtime_error("madvise(MADV_HUGEPAGE) failed, is THP disabled?");
+      if (pages == Pages::Small && madvise(data_, bytes, MADV_NOHUGEPAGE) != 0)
+        throw runtime_error("madvise(MADV_NOHUGEPAGE) failed");
+      if (!memNodes.empty()) {
+        const size_t bitsPerWord = 8 * sizeof(unsigned long);
+        vector<unsigned long> nodeMask(*max_element(memNodes.begin(), memNodes.end()) / bitsPerWord + 1);
+        for (int node : memNodes)
+          nodeMask[node / bitsPerWord] |= 1ul << (node % bitsPerWord);
+        int mode = memNodes.size() > 1 ? MPOL_INTERLEAVE : MPOL_BIND;
+        if (syscall(SYS_mbind, data_, bytes, mode, nodeMask.data(), nodeMask.size() * bitsPerWord + 1, 0) != 0)
+          throw runtime_error("mbind failed");
+      }
+#else // msvs & others
+      if (pages != Pages::Default)
+        throw runtime_error(string("page size ") + pagesName(pages) + " is only supported on Linux");
+      if (!memNodes.empty())
+        throw runtime_error("NUMA placement (--placement, --numa-matrix) is only supported on Linux");
+      // page-aligned here too since the streaming store kernels need aligned vectors
+#ifdef _MSC_VER
+      data_ = _aligned_malloc(bytes, 4096);
+#else
+      if (posix_memalign(&data_, 4096, bytes) != 0)
+        data_ = nullptr;
+#endif
+      mapped_ = data_;
+      if (data_ == nullptr)
+        throw runtime_error("aligned alloc failed for " + to_string(bytes) + " bytes");
+#endif
+    }
+
+    void* data() const { return data_; }
+
+  private:
+    Mapping(const Mapping&); // = delete, but vs2012
+    Mapping& operator=(const Mapping&);
+
+    void release() {
+#ifdef __linux__
+      if (mapped_ != nullptr)
+        munmap(mapped_, mappedBytes_);
+#elif defined(_MSC_VER)
+      _aligned_free(mapped_);
+#else
+      free(mapped_);
+#endif
+      mapped_ = data_ = nullptr;
+    }
+
+    void* mapped_;
+    size_t mappedBytes_;
+    void* data_;
+};
+
+// float array for the kernels
+class WorkArea {
+  public:
+    WorkArea() : size_(0) {}
+
+    void allocate(size_t size, Pages pages, const vector<int>& memNodes) {
+      mapping_.map(size * sizeof(float), pages, memNodes);
+      size_ = size;
+    }
+
+    // this is what first-touches the pages
+    void fill(float value) { std::fill(data(), data() + size_, value); }
+
+    float* data() { return static_cast<float*>(mapping_.data()); }
+    const float* data() const { return static_cast<const float*>(mapping_.data()); }
+    size_t size() const { return size_; }
+
+  private:
+    Mapping mapping_;
+    size_t size_;
+};
+
+// STREAM's a, b, c arrays. Only those in kernel.arrays get allocated.
+typedef array<WorkArea, 3> WorkAreas;
+
+// elem count of the allocated arrays
+size_t elemCount(const WorkAreas& workAreas) {
+  return max(workAreas[0].size(), max(workAreas[1].size(), workAreas[2].size()));
+}
+
+// Kernel over elems [begin, end). Returns a value depending on what was read
+// so that the optimizer cannot drop the read-only kernel.
+float runKernelRange(Kernel kernel, float* a, float* b, float* c, size_t begin, size_t end, float scalar) {
+  float sum = 0;
+  switch (kernel) {
+    case Kernel::Increment:
+      for (size_t i=begin; i<end; ++i)
+        ++a[i]; // this here is the 'work' being done
+      break;
+    case Kernel::Copy:
+      for (size_t i=begin; i<end; ++i)
+        c[i] = a[i];
+      break;
+    case Kernel::Scale:
+      for (size_t i=begin; i<end; ++i)
+        b[i] = scalar * c[i];
+      break;
+    case Kernel::Add:
+      for (size_t i=begin; i<end; ++i)
+        c[i] = a[i] + b[i];
+      break;
+    case Kernel::Triad:
+      for (size_t i=begin; i<end; ++i)
+        a[i] = b[i] + scalar * c[i];
+      break;
+    case Kernel::ReadOnly:
+      for (size_t i=begin; i<end; ++i)
+        sum += a[i];
+      break;
+    case Kernel::WriteOnly:
+      for (size_t i=begin; i<end; ++i)
+        a[i] = scalar;
+      break;
+  }
+  return sum;
+}
+
+// One pass of the kernel over all elems, vectorized by whatever the compiler
+// does at the current -O level.
+float runKernelOnce(Kernel kernel, WorkAreas& workAreas, float scalar) {
+  return runKernelRange(kernel, workAreas[0].data(), workAreas[1].data(), workAreas[2].data(),
+                        0, elemCount(workAreas), scalar);
+}
+
+// Hand-vectorized variants of runKernelOnce, one per ISA level. These are
+// compiled with per-function target attributes so that the rest of the
+// binary still runs on any x86, and get picked at runtime via CPUID. The
+// read kernel uses 4 accumulators so that it is bound by loads rather
+// than by the latency of the adds. Leftover elems go through runKernelRange.
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h> // __cpuid
+#define TARGET_SSE2
+#define TARGET_AVX2
+#define TARGET_AVX512
+#else
+#include <x86intrin.h> // __rdtsc
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
+// Store & prefetch flavors shared by all ISA variants: nonTemporal uses
+// streaming stores that bypass the caches, which saves the read-for-ownership
+// of each destination line. prefetch issues a software prefetch for each
+// source array prefetchElems ahead of the current elem.
+template <bool nonTemporal, bool prefetch>
+TARGET_SSE2 float runKernelOnceSse2(Kernel kernel, WorkAreas& workAreas, float scalar, size_t prefetchElems) {
+#define STORE(p, v) (nonTemporal ? _mm_stream_ps(p, v) : _mm_storeu_ps(p, v))
+#define PREFETCH(p) if (prefetch) _mm_prefetch(reinterpret_cast<const char*>((p) + prefetchElems), _MM_HINT_T0)
+  const size_t n = elemCount(workAreas);
+  const size_t w = 4;
+  float* a = workAreas[0].data();
+  float* b = workAreas[1].data();
+  float* c = workAreas[2].data();
+  const __m128 s = _mm_set1_ps(scalar);
+  const __m128 one = _mm_set1_ps(1.0f);
+  size_t i = 0;
+  float sum = 0;
+  switch (kernel) {
+    case Kernel::Increment:
+      for (; i+w<=n; i+=w) {
+        PREFETCH(a+i);
+        STORE(a+i, _mm_add_ps(_mm_loadu_ps(a+i), one));
+      }
+      break;
+    case Kernel::Copy:
+      for (; i+w<=n; i+=w) {
+        PREFETCH(a+i);
+        STORE(c+i, _mm_loadu_ps(a+i));
+      }
+      break;
+    case Kernel::Scale:
+      for (; i+w<=n; i+=w) {
+        PREFETCH(c+i);
+        STORE(b+i, _mm_mul_ps(s, _mm_loadu_ps(c+i)));
+      }
+      break;
+    case Kernel::Add:
+      for (; i+w<=n; i+=w) {
+        PREFETCH(a+i);
+        PREFETCH(b+i);
+        STORE(c+i, _mm_add_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)));
+      }
+      break;
+    case Kernel::Triad:
+      for (; i+w<=n; i+=w) {
+        PREFETCH(b+i);
+        PREFETCH(c+i);
+        STORE(a+i, _mm_add_ps(_mm_loadu_ps(b+i), _mm_mul_ps(s, _mm_loadu_ps(c+i))));
+      }
+      break;
+    case Kernel::ReadOnly: {
+      __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps(), acc2 = _mm_setzero_ps(), acc3 = _mm_setzero_ps();
+      for (; i+4*w<=n; i+=4*w) {
+        PREFETCH(a+i);
+        acc0 = _mm_add_ps(acc0, _mm_loadu_ps(a+i));
+        acc1 = _mm_add_ps(acc1, _mm_loadu_ps(a+i+w));
+        acc2 = _mm_add_ps(acc2, _mm_loadu_ps(a+i+2*w));
+        acc3 = _mm_add_ps(acc3, _mm_loadu_ps(a+i+3*w));
+      }
+      float lanes[w];
+      _mm_storeu_ps(lanes, _mm_add_ps(_mm_add_ps(acc0, acc1), _mm_add_ps(acc2, acc3)));
+      for (float lane : lanes)
+        sum += lane;
+      break;
+    }
+    case Kernel::WriteOnly:
+      for (; i+w<=n; i+=w)
+        STORE(a+i, s);
+      break;
+  }
+#undef STORE
+#undef PREFETCH
+  if (nonTemporal)
+    _mm_sfence(); // streaming stores are weakly ordered
+  return sum + runKernelRange(kernel, a, b, c, i, n, scalar);
+}
+
+template <bool nonTemporal, bool prefetch>
+TARGET_AVX2 float runKernelOnceAvx2(Kernel kernel, WorkAreas& workAreas, float scalar, size_t prefetchElems) {
+#define STORE(p, v) (nonTemporal ? _mm256_stream_ps(p, v) : _mm256_storeu_ps(p, v))
+#define PREFETCH(p) if (prefetch) _mm_prefetch(reinterpret_cast<const char*>((p) + prefetchElems), _MM_HINT_T0)
+  const size_t n = elemCount(workAreas);
+  const size_t w = 8;
+  float* a = workAreas[0].data();
+  float* b = workAreas[1].data();
+  float* c = workAreas[2].data();
+  const __m256 s = _mm256_set1_ps(scalar);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  size_t i = 0;
+  float sum = 0;
+  switch (kernel) {
+    case Kernel::Increment:
+      for (; i+w<=n; i+=w) {
+        PREFETCH(a+i);
+        STORE(a+i, _mm256_add_ps(_mm256_loadu_ps(a+i), one));
+      }
+      break;
+    case Kernel::Copy:
+      for (; i+w<=n; i+=w) {
+        PREFETCH(a+i);
+        STORE(c+i, _mm256_loadu_ps(a+i));
+      }
+      break;
+    case Kernel::Scale:
+      for (; i+w<=n; i+=w) {
+        PREFETCH(c+i);
+        STORE(b+i, _mm256_mul_ps(s, _mm256_loadu_ps(c+i)));
+      }
+      break;
+    case Kernel::Add:
+      for (; i+w<=n; i+=w) {
+        PREFETCH(a+i);
+        PREFETCH(b+i);
+        STORE(c+i, _mm256_add_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i)));
+      }
+      break;
+    case Kernel::Triad:
+      for (; i+w<=n; i+=w) {
+        PREFETCH(b+i);
+        PREFETCH(c+i);
+        STORE(a+i, _mm256_fmadd_ps(s, _mm256_loadu_ps(c+i), _mm256_loadu_ps(b+i)));
+      }
+      break;
+    case Kernel::ReadOnly: {
+      __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps(), acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+      for (; i+4*w<=n; i+=4*w) {
+        PREFETCH(a+i);
+        acc0 = _mm256_add_ps(acc0, _mm256_loadu_ps(a+i));
+        acc1 = _mm256_add_ps(acc1, _mm256_loadu_ps(a+i+w));
+        acc2 = _mm256_add_ps(acc2, _mm256_loadu_ps(a+i+2*w));
+        acc3 = _mm256_add_ps(acc3, _mm256_loadu_ps(a+i+3*w));
+      }
+      float lanes[w];
+      _mm256_storeu_ps(lanes, _mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+      for (float lane : lanes)
+        sum += lane;
+      break;
+    }
+    case Kernel::WriteOnly:
+      for (; i+w<=n; i+=w)
+        STORE(a+i, s);
+      break;
+  }
+#undef STORE
+#undef PREFETCH
+  if (nonTemporal)
+    _mm_sfence(); // streaming stores are weakly ordered
+  _mm256_zeroupper(); // avoid AVX-SSE transition penalties in the scalar code that follows
+  return sum + runKernelRange(kernel, a, b, c, i, n, scalar);
+}
+
+template <bool nonTemporal, bool prefetch>
+TARGET_AVX512 float runKernelOnceAvx512(Kernel kernel, WorkAreas& workAreas, float scalar, size_t prefetchElems) {
+#define STORE(p, v) (nonTemporal ? _mm512_stream_ps(p, v) : _mm512_storeu_ps(p, v))
+#define PREFETCH(p) if (prefetch) _mm_prefetch(reinterpret_cast<const char*>((p) + prefetchElems), _MM_HINT_T0)
+  const size_t n = elemCount(workAreas);
+  const size_t w = 16;
+  float* a = workAreas[0].data();
+  float* b = workAreas[1].data();
+  float* c = workAreas[2].data();
+  const __m512 s = _mm512_set1_ps(scalar);
+  const __m512 one = _mm512_set1_ps(1.0f);
+  size_t i = 0;
+  float sum = 0;
+  switch (kernel) {
+    case Kernel::Increment:
+      for (; i+w<=n; i+=w) {
+        PREFETCH(a+i);
+        STORE(a+i, _mm512_add_ps(_mm512_loadu_ps(a+i), one));
+      }
+      break;
+    case Kernel::Copy:
+      for (; i+w<=n; i+=w) {
+        PREFETCH(a+i);
+        STORE(c+i, _mm512_loadu_ps(a+i));
+      }
+      break;
+    case Kernel::Scale:
+      for (; i+w<=n; i+=w) {
+        PREFETCH(c+i);
+        STORE(b+i, _mm512_mul_ps(s, _mm512_loadu_ps(c+i)));
+      }
+      break;
+    case Kernel::Add:
+      for (; i+w<=n; i+=w) {
+        PREFETCH(a+i);
+        PREFETCH(b+i);
+        STORE(c+i, _mm512_add_ps(_mm512_loadu_ps(a+i), _mm512_loadu_ps(b+i)));
+      }
+      break;
+    case Kernel::Triad:
+      for (; i+w<=n; i+=w) {
+        PREFETCH(b+i);
+        PREFETCH(c+i);
+        STORE(a+i, _mm512_fmadd_ps(s, _mm512_loadu_ps(c+i), _mm512_loadu_ps(b+i)));
+      }
+      break;
+    case Kernel::ReadOnly: {
+      __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps(), acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+      for (; i+4*w<=n; i+=4*w) {
+        PREFETCH(a+i);
+        acc0 = _mm512_add_ps(acc0, _mm512_loadu_ps(a+i));
+        acc1 = _mm512_add_ps(acc1, _mm512_loadu_ps(a+i+w));
+        acc2 = _mm512_add_ps(acc2, _mm512_loadu_ps(a+i+2*w));
+        acc3 = _mm512_add_ps(acc3, _mm512_loadu_ps(a+i+3*w));
+      }
+      float lanes[w];
+      _mm512_storeu_ps(lanes, _mm512_add_ps(_mm512_add_ps(acc0, acc1), _mm512_add_ps(acc2, acc3)));
+      for (float lane : lanes)
+        sum += lane;
+      break;
+    }
+    case Kernel::WriteOnly:
+      for (; i+w<=n; i+=w)
+        STORE(a+i, s);
+      break;
+  }
+#undef STORE
+#undef PREFETCH
+  if (nonTemporal)
+    _mm_sfence(); // streaming stores are weakly ordered
+  _mm256_zeroupper();
+  return sum + runKernelRange(kernel, a, b, c, i, n, scalar);
+}
+
+// CPUID based, including the check that the OS saves the wide registers
+bool cpuSupports(const string& feature) {
+#ifdef _MSC_VER
+  int regs[4];
+  __cpuid(regs, 1);
+  const bool osAvx = (regs[2] & (1 << 27)) != 0 && (_xgetbv(0) & 0x6) == 0x6;
+  const bool osAvx512 = osAvx && (_xgetbv(0) & 0xe6) == 0xe6;
+  const bool sse2 = (regs[3] & (1 << 26)) != 0;
+  const bool fma = (regs[2] & (1 << 12)) != 0; // the avx2 kernels use _mm256_fmadd_ps
+  __cpuidex(regs, 7, 0);
+  if (feature == "sse2")
+    return sse2;
+  if (feature == "avx2")
+    return osAvx && fma && (regs[1] & (1 << 5)) != 0;
+  if (feature == "avx512f")
+    return osAvx512 && (regs[1] & (1 << 16)) != 0;
+  return false;
+#else
+  __builtin_cpu_init();
+  if (feature == "sse2")
+    return __builtin_cpu_supports("sse2");
+  if (feature == "avx2")
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  if (feature == "avx512f")
+    return __builtin_cpu_supports("avx512f");
+  return false;
+#endif
+}
+#endif // HAVE_X86_SIMD
+
+typedef float (*KernelFunc)(Kernel kernel, WorkAreas& workAreas, float scalar, size_t prefetchElems);
+
+float runKernelOnceAuto(Kernel kernel, WorkAreas& workAreas, float scalar, size_t) {
+  return runKernelOnce(kernel, workAreas, scalar);
+}
+
+struct IsaInfo {
+  const char* name;
+  KernelFunc funcs[2][2]; // [nonTemporal][prefetch], nullptr if the variant is unavailable
+  const char* cpuFeature; // nullptr if always available
+};
+
+#define KERNEL_FUNCS(f) { { f<false, false>, f<false, true> }, { f<true, false>, f<true, true> } }
+
+// in order of increasing vector width
+const IsaInfo isaInfos[] = {
+  // whatever the compiler auto-vectorized, can't do streaming stores or prefetch
+  { "auto", { { runKernelOnceAuto, nullptr }, { nullptr, nullptr } }, nullptr },
+#ifdef HAVE_X86_SIMD
+  { "sse2", KERNEL_FUNCS(runKernelOnceSse2), "sse2" },
+  { "avx2", KERNEL_FUNCS(runKernelOnceAvx2), "avx2" },
+  { "avx512", KERNEL_FUNCS(runKernelOnceAvx512), "avx512f" },
+#endif
+};
+
+#undef KERNEL_FUNCS
+
+// which function runs a kernel: ISA plus store & prefetch flavor
+struct KernelVariant {
+  const IsaInfo* isa;
+  bool nonTemporal;
+  size_t prefetchBytes; // 0 for no software prefetch
+
+  KernelFunc func() const { return isa->funcs[nonTemporal][prefetchBytes != 0]; }
+  string name() const {
+    string s = isa->name;
+    if (nonTemporal)
+      s += "+nt";
+    if (prefetchBytes != 0)
+      s += "+pf" + to_string(prefetchBytes);
+    return s;
+  }
+};
+
+bool isSupported(const IsaInfo& isa) {
+#ifdef HAVE_X86_SIMD
+  return isa.cpuFeature == nullptr || cpuSupports(isa.cpuFeature);
+#else
+  return isa.cpuFeature == nullptr;
+#endif
+}
+
+const IsaInfo* findIsa(const string& name) {
+  for (const auto& info : isaInfos)
+    if (name == info.name)
+      return &info;
+  return nullptr;
+}
+
+// widest ISA the cpu supports
+const IsaInfo& bestIsa() {
+  const IsaInfo* best = &isaInfos[0];
+  for (const auto& info : isaInfos)
+    if (isSupported(info))
+      best = &info;
+  return *best;
+}
+
+// Cheap timestamps for the timed loop. On x86 that's the TSC, which on
+// anything recent ticks at a constant rate regardless of the core clock
+// (invariant TSC) and costs ~20 cycles to read, vs. a steady_clock::now()
+// that may well be a syscall. Elsewhere it's just steady_clock in ns.
+struct TickClock {
+  double ticksPerSec;
+  double overheadTicks; // cost of one now()
+
+  static uint64_t now() {
+#ifdef HAVE_X86_SIMD
+    return __rdtsc();
+#else
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+
+  // calibrated once against steady_clock
+  static const TickClock& get() {
+    static const TickClock clock = calibrate();
+    return clock;
+  }
+
+private:
+  static TickClock calibrate() {
+    TickClock clock;
+    auto t0 = chrono::steady_clock::now();
+    uint64_t c0 = now();
+    auto t1 = t0;
+    while (t1 - t0 < chrono::milliseconds(20))
+      t1 = chrono::steady_clock::now();
+    uint64_t c1 = now();
+    clock.ticksPerSec = (c1 - c0) / chrono::duration<double>(t1 - t0).count();
+
+    // best of a few runs of back-to-back reads
+    const int readN = 1000;
+    clock.overheadTicks = 1e30;
+    for (int run=0; run<10; ++run) {
+      uint64_t start = now(), last = start;
+      for (int i=0; i<readN; ++i)
+        last = now();
+      clock.overheadTicks = min(clock.overheadTicks, static_cast<double>(last - start) / readN);
+    }
+    return clock;
+  }
+};
+
+// Returns the number of passes over the work areas completed before tEnd.
+// The old loop checked steady_clock after every pass, which for a 10 float
+// work area was most of what got measured. Now the pass count per timer
+// read gets calibrated first (doubling until a batch takes >= 20 us, i.e.
+// the tick read is ~0.1% of it), then whole batches run between tick reads
+// with only every 64th batch double checking steady_clock in case the TSC
+// misbehaves. The calibration passes count too, they're real work done
+// inside the window.
+// @param timerOverheadPct receives the share of the loop spent reading the clock
+uint64_t memBandwithWaster(Kernel kernel, KernelFunc kernelFunc, size_t prefetchElems,
+                           WorkAreas& workAreas, chrono::steady_clock::time_point tEnd, double& timerOverheadPct) {
+  const TickClock& clock = TickClock::get();
+  const uint64_t tStart = TickClock::now();
+  const uint64_t tDeadline = tStart + static_cast<uint64_t>(
+    max(0.0, chrono::duration<double>(tEnd - chrono::steady_clock::now()).count()) * clock.ticksPerSec);
+  const uint64_t minBatchTicks = static_cast<uint64_t>(max(20e-6 * clock.ticksPerSec, 1000 * clock.overheadTicks));
+
+  uint64_t loopCount = 0;
+  uint64_t timerReads = 0;
+  volatile float sink = 0; // keeps the read-only kernel alive
+  auto runBatch = [&](uint64_t passN) {
+    for (uint64_t i=0; i<passN; ++i) {
+      // varying the scalar keeps the write-only kernel from being hoisted out of the loop
+      sink = sink + kernelFunc(kernel, workAreas, 3.0f + (loopCount & 1), prefetchElems);
+      ++loopCount;
+    }
+    ++timerReads;
+    return TickClock::now();
+  };
+
+  uint64_t batch = 1;
+  uint64_t t = tStart;
+  for (uint64_t t0 = t; t < tDeadline; batch *= 2) {
+    t = runBatch(batch);
+    if (t - t0 >= minBatchTicks)
+      break;
+    t0 = t;
+  }
+  for (uint64_t batchN = 1; t < tDeadline; ++batchN) {
+    t = runBatch(batch);
+    if (batchN % 64 == 0 && chrono::steady_clock::now() >= tEnd)
+      break;
   }
-  auto totalFlopCount = loopCount * workAreaSize;
-  cout << "  loopCount=" << loopCount << "\n";
-  return totalFlopCount;
+
+  timerOverheadPct = t > tStart ? 100.0 * timerReads * clock.overheadTicks / (t - tStart) : 0;
+  ostringstream line; // one write, workers finish at the same time
+  line << "  loopCount=" << loopCount << " batch=" << batch << " timerOverhead=" << timerOverheadPct << "%\n";
+  progress() << line.str();
+  return loopCount;
 }
 
 struct Worker {
-  thread thread;
-  vector<float> workArea;
-  int totalFlopCount; // result of memBandwithWaster(workArea)
+  std::thread thread; // std:: qualified since gcc rejects the member changing the meaning of thread
+  WorkAreas workAreas;
+  uint64_t passCount; // result of memBandwithWaster(workAreas)
+  double timerOverheadPct;
+  PerfCounts perfCounts;
 
   // not needed for clang, but for msvs 2012:
   // (this code sucks btw)
 #ifdef _MSC_VER // msvs
   Worker(const Worker& rhs) {
-    if (rhs.thread.get_id() != thread::id())
-      throw std::runtime_error("rhs.thread was supposed to be a default-constructed thread");
-    workArea = rhs.workArea;
-    totalFlopCount = rhs.totalFlopCount;
+    if (rhs.thread.get_id() != thread::id() || rhs.workAreas[0].data() != nullptr)
+      throw std::runtime_error("rhs was supposed to be a default-constructed worker");
+    passCount = rhs.passCount;
+    timerOverheadPct = rhs.timerOverheadPct;
+    perfCounts = rhs.perfCounts;
   }
   // and rule of 3/5 tedium:
   Worker operator=(const Worker& rhs) {
-    if (rhs.thread.get_id() != thread::id())
-      throw std::runtime_error("rhs.thread was supposed to be a default-constructed thread");
-    workArea = rhs.workArea;
-    totalFlopCount = rhs.totalFlopCount;
+    if (rhs.thread.get_id() != thread::id() || rhs.workAreas[0].data() != nullptr)
+      throw std::runtime_error("rhs was supposed to be a default-constructed worker");
+    passCount = rhs.passCount;
+    timerOverheadPct = rhs.timerOverheadPct;
+    perfCounts = rhs.perfCounts;
     return *this;
   }
   Worker() {}
 #endif
-  
+
 };
 
-// @param workAreaSize in floats
-void computeMegaflops(int threadN, int workAreaSize) {
+// nodes the work areas of a worker pinned to cpu get bound to (empty for first touch)
+vector<int> memNodesFor(const Placement& placement, const NumaTopology& topology, int cpu) {
+  const auto& nodes = topology.nodes;
+  switch (placement.memPolicy) {
+    case MemPolicy::FirstTouch:
+      return vector<int>();
+    case MemPolicy::Local:
+      return vector<int>(1, topology.nodeOfCpu(cpu));
+    case MemPolicy::Remote: {
+      if (nodes.size() < 2) // main() rejects this, but don't ever label local runs remote
+        throw runtime_error("remote placement needs at least 2 NUMA nodes");
+      auto local = find(nodes.begin(), nodes.end(), topology.nodeOfCpu(cpu));
+      return vector<int>(1, ++local == nodes.end() ? nodes.front() : *local);
+    }
+    case MemPolicy::Interleave:
+      return nodes;
+    case MemPolicy::Node:
+      return vector<int>(1, placement.memNode);
+  }
+  return vector<int>();
+}
+
+// @param workAreaSize in floats (per array, so triad touches 3x that)
+// @param timerOverheadPct receives the worst timer overhead of all threads
+// @param perf receives the hw counters of the timed loops summed over all threads
+// @return GB/s summed over all threads
+double computeBandwidth(const KernelInfo& kernel, const KernelVariant& variant, int threadN, int workAreaSize,
+                        const Placement& placement, int durationMs, double& timerOverheadPct, PerfCounts& perf) {
 
-  auto t0 = chrono::steady_clock::now();
-  auto tEnd = t0 + chrono::seconds(1);
+  static const NumaTopology topology = readNumaTopology();
+  TickClock::get(); // calibrate before any worker runs
+  const vector<int> cpus = placement.cpus.empty() ? topology.allCpus() : placement.cpus;
+
+  // Initial values are the same as in STREAM. Setting these is what
+  // first-touches the pages, so it runs either on the main thread before
+  // spawning workers (the OS then puts all pages on the main thread's node
+  // unless mbind() says otherwise) or on each worker.
+  auto setupWorkAreas = [&kernel, &placement, workAreaSize](WorkAreas& workAreas, const vector<int>& memNodes) {
+    const float initialValues[] = { 1.0f, 2.0f, 0.0f };
+    for (int i=0; i<3; ++i) {
+      if ((kernel.arrays & (1 << i)) == 0)
+        continue;
+      workAreas[i].allocate(workAreaSize, placement.pages, memNodes);
+      workAreas[i].fill(initialValues[i]);
+    }
+  };
 
-  // setup all workareas before starting the worker threads
   vector<Worker> workers(threadN);
-  for (auto& worker : workers)
-    worker.workArea.resize(workAreaSize);
+  if (!placement.workerFirstTouch)
+    for (int i=0; i<threadN; ++i)
+      setupWorkAreas(workers[i].workAreas, memNodesFor(placement, topology, cpus[i % cpus.size()]));
 
-  // now spawn workers, one for each work area
-  for (auto& worker : workers) {
-    thread workerThread([&worker, tEnd]() { 
-      worker.totalFlopCount = memBandwithWaster(worker.workArea, tEnd);
+  // now spawn workers, one for each work area. All of them start the timed
+  // loop together once everyone finished setup, the start signal carries tEnd.
+  promise<chrono::steady_clock::time_point> startPromise;
+  shared_future<chrono::steady_clock::time_point> start = startPromise.get_future().share();
+  vector<future<void>> ready;
+  for (int i=0; i<threadN; ++i) {
+    auto& worker = workers[i];
+    int cpu = cpus[i % cpus.size()];
+    auto readyPromise = make_shared<promise<void>>();
+    ready.push_back(readyPromise->get_future());
+    Kernel k = kernel.kernel;
+    KernelFunc kernelFunc = variant.func();
+    size_t prefetchElems = variant.prefetchBytes / sizeof(float);
+    thread workerThread([&worker, &placement, &setupWorkAreas, k, kernelFunc, prefetchElems, cpu, start, readyPromise]() {
+      // an exception escaping the thread would terminate, so setup errors
+      // (pinning, mbind) go to the main thread instead
+      unique_ptr<PerfCounters> counters;
+      try {
+        if (placement.pinThreads)
+          pinThisThread(cpu);
+        if (placement.workerFirstTouch)
+          setupWorkAreas(worker.workAreas, memNodesFor(placement, topology, cpu));
+        counters = openPerfCounters();
+      }
+      catch (...) {
+        readyPromise->set_exception(current_exception());
+        return;
+      }
+      readyPromise->set_value();
+      auto tEnd = start.get();
+      if (counters)
+        counters->start();
+      worker.passCount = memBandwithWaster(k, kernelFunc, prefetchElems, worker.workAreas, tEnd, worker.timerOverheadPct);
+      if (counters)
+        worker.perfCounts = counters->stop();
     });
     std::swap(worker.thread, workerThread);
   }
+  exception_ptr setupError;
+  for (auto& r : ready) {
+    try {
+      r.get();
+    }
+    catch (...) {
+      if (!setupError)
+        setupError = current_exception();
+    }
+  }
+  auto t0 = chrono::steady_clock::now();
+  // after a failed setup the others get a tEnd that has passed already
+  startPromise.set_value(setupError ? t0 : t0 + chrono::milliseconds(durationMs));
+  if (setupError) {
+    for (auto& worker : workers)
+      worker.thread.join();
+    rethrow_exception(setupError);
+  }
 
-  // aggregate result: sum of each thread's megaflops
-  float totalFlopCount = 0;
+  // aggregate result: sum of each thread's bytes moved
+  double totalBytes = 0;
+  timerOverheadPct = 0;
   for (auto& worker : workers) {
     worker.thread.join();
-    totalFlopCount += worker.totalFlopCount;
+    totalBytes += static_cast<double>(worker.passCount) * workAreaSize * kernel.bytesPerElem;
+    timerOverheadPct = max(timerOverheadPct, worker.timerOverheadPct);
+    perf += worker.perfCounts;
+  }
+
+  auto totalTime = chrono::duration<double>(chrono::steady_clock::now() - t0);
+  auto gigaBytesPerSec = totalBytes / totalTime.count() / 1e9;
+
+  progress() << "computeBandwidth(" << kernel.name << "/" << variant.name() << ", " << threadN << ", " << workAreaSize
+    << ") => totalBytes=" << totalBytes
+    << " totalTimeInMs=" << chrono::duration_cast<chrono::milliseconds>(totalTime).count()
+    << " => " << gigaBytesPerSec << " GB/s\n";
+  if (perfEnabled) {
+    progress() << "  perf: " << perf.summary();
+    // the telling ratio: how many of the (64 byte) lines moved came from DRAM
+    if (perf.has(PerfEvent::LlcMisses) && totalBytes > 0)
+      progress() << " llcMisses/line=" << perf[PerfEvent::LlcMisses] / (totalBytes / 64);
+    progress() << '\n';
+  }
+  return gigaBytesPerSec;
+}
+
+string describe(const Placement& placement) {
+  string s;
+  switch (placement.memPolicy) {
+    case MemPolicy::FirstTouch: s = "first-touch"; break;
+    case MemPolicy::Local: s = "local"; break;
+    case MemPolicy::Remote: s = "remote"; break;
+    case MemPolicy::Interleave: s = "interleave"; break;
+    case MemPolicy::Node: s = "node" + to_string(placement.memNode); break;
+  }
+  if (placement.workerFirstTouch)
+    s += "+worker-touch";
+  if (placement.pinThreads)
+    s += "+pinned";
+  return s;
+}
+
+Record measureBandwidth(const KernelInfo& kernel, const KernelVariant& variant, int threadN, int workAreaSize,
+                        const Placement& placement, const Sampling& sampling) {
+  Record record;
+  record.mode = "bandwidth";
+  record.kernel = kernel.name;
+  record.isa = variant.isa->name;
+  record.nonTemporal = variant.nonTemporal;
+  record.prefetchBytes = variant.prefetchBytes;
+  record.threads = threadN;
+  const int arrayCount = ((kernel.arrays >> 0) & 1) + ((kernel.arrays >> 1) & 1) + ((kernel.arrays >> 2) & 1);
+  record.bytesPerThread = static_cast<uint64_t>(workAreaSize) * arrayCount * sizeof(float);
+  record.placement = describe(placement);
+  record.pages = pagesName(placement.pages);
+  record.unit = "GB/s";
+  record.stats = repeatRun(sampling, [&]() {
+    double timerOverheadPct;
+    PerfCounts perf;
+    double gbs = computeBandwidth(kernel, variant, threadN, workAreaSize, placement, sampling.durationMs, timerOverheadPct, perf);
+    record.timerOverheadPct = max(record.timerOverheadPct, timerOverheadPct);
+    record.perf = perf;
+    return gbs;
+  });
+  return record;
+}
+
+// Bandwidth for each (cpu node, memory node) pair: all cpus of the cpu node
+// run the kernel with their work areas bound to the memory node.
+void runNumaMatrix(const KernelInfo& kernel, const KernelVariant& variant, int workAreaSize, Pages pages, const Sampling& sampling, vector<Record>& records) {
+  const NumaTopology topology = readNumaTopology();
+  vector<vector<double>> matrix;
+  progress() << "\n\ntesting numa bandwidth matrix for " << kernel.name << "/" << variant.name() << " with workAreaSize=" << workAreaSize
+             << " and " << pagesName(pages) << " pages\n";
+  for (size_t cpuNode=0; cpuNode<topology.nodes.size(); ++cpuNode) {
+    matrix.push_back(vector<double>());
+    const auto& cpus = topology.nodeCpus[cpuNode];
+    for (int memNode : topology.nodes) {
+      if (cpus.empty()) { // memory-only node
+        matrix.back().push_back(0);
+        continue;
+      }
+      Placement placement;
+      placement.pinThreads = true;
+      placement.workerFirstTouch = true;
+      placement.memPolicy = MemPolicy::Node;
+      placement.cpus = cpus;
+      placement.memNode = memNode;
+      placement.pages = pages;
+      Record record = measureBandwidth(kernel, variant, static_cast<int>(cpus.size()), workAreaSize, placement, sampling);
+      record.mode = "numa-matrix";
+      record.placement = "cpu" + to_string(topology.nodes[cpuNode]) + "/mem" + to_string(memNode);
+      matrix.back().push_back(record.stats.median);
+      records.push_back(record);
+    }
+  }
+
+  progress() << "\nnuma bandwidth matrix (" << kernel.name << ", median GB/s), rows: cpu node, columns: memory node\n";
+  progress() << setw(8) << "";
+  for (int memNode : topology.nodes)
+    progress() << setw(10) << ("mem" + to_string(memNode));
+  progress() << '\n';
+  for (size_t cpuNode=0; cpuNode<topology.nodes.size(); ++cpuNode) {
+    progress() << setw(8) << ("cpu" + to_string(topology.nodes[cpuNode]));
+    for (double gbs : matrix[cpuNode]) {
+      ostringstream cell;
+      cell << fixed << setprecision(2) << gbs;
+      progress() << setw(10) << cell.str();
+    }
+    progress() << '\n';
   }
+}
+
+// Pointer-chasing latency probe. Each cache line of the buffer holds a
+// pointer to the next line, and the lines are linked in random order into a
+// single cycle. Each load depends on the previous one, so neither the
+// prefetcher nor out-of-order execution can hide the latency, and the
+// L1/L2/L3/DRAM steps show up as the buffer grows.
+
+struct ChaseLine {
+  ChaseLine* next;
+  char padding[cacheLineSize - sizeof(ChaseLine*)];
+};
+
+// @return ns per dependent load for a buffer of bufferBytes. The buffer is
+// built once, each repetition is one 500ms chase through it.
+// @param perf receives the hw counters of the last timed chase, with --perf
+Stats measureLoadLatency(size_t bufferBytes, Pages pages, const Sampling& sampling, PerfCounts& perf) {
+  const size_t lineN = max<size_t>(bufferBytes / sizeof(ChaseLine), 2);
+  Mapping mapping;
+  mapping.map(lineN * sizeof(ChaseLine), pages, vector<int>());
+  ChaseLine* lines = static_cast<ChaseLine*>(mapping.data());
+
+  // Sattolo's algorithm: a random permutation that is a single cycle, so
+  // the chase visits every line before coming back to the start. It permutes
+  // the next ptrs in place, so there's no index array whose width would
+  // limit the buffer size (32 bit indices wrap at 256 GiB).
+  for (size_t i=0; i<lineN; ++i)
+    lines[i].next = &lines[i];
+  mt19937_64 rng(42);
+  for (size_t i=lineN-1; i>0; --i)
+    swap(lines[i].next, lines[uniform_int_distribution<size_t>(0, i-1)(rng)].next);
 
-  auto totalTimeInMs = chrono::duration_cast<chrono::milliseconds>(
-                         chrono::steady_clock::now() - t0).count();
-  auto megaFlops =
-    (totalFlopCount * 1000.0f / totalTimeInMs) 
-    / (1000*1000.0f);
+  // warm up caches & TLBs, capped so that multi-GiB buffers don't take forever
+  ChaseLine* p = &lines[0];
+  for (size_t i=0, warmupN=min<size_t>(lineN, 4 * 1024 * 1024); i<warmupN; ++i)
+    p = p->next;
 
-  cout << "computeMegaflops(" << threadN << ", " << workAreaSize 
-    << ") => totalFlopCount=" << static_cast<int>(totalFlopCount)
-    << " totalTimeInMs=" << totalTimeInMs
-    << " => " << megaFlops << " megaFlops\n";
+  return repeatRun(sampling, [&p, &perf]() {
+    const int batchN = 1024; // loads between clock checks
+    uint64_t loadCount = 0;
+    auto counters = openPerfCounters();
+    if (counters)
+      counters->start();
+    auto t0 = chrono::steady_clock::now();
+    auto tEnd = t0 + chrono::milliseconds(500);
+    auto t1 = t0;
+    do {
+      for (int i=0; i<batchN; i+=8) {
+        p = p->next; p = p->next; p = p->next; p = p->next;
+        p = p->next; p = p->next; p = p->next; p = p->next;
+      }
+      loadCount += batchN;
+      t1 = chrono::steady_clock::now();
+    } while (t1 < tEnd);
+    if (counters) {
+      perf = counters->stop();
+      progress() << "  perf: " << perf.summary();
+      if (perf.has(PerfEvent::DtlbMisses))
+        progress() << " dtlbMisses/load=" << static_cast<double>(perf[PerfEvent::DtlbMisses]) / loadCount;
+      if (perf.has(PerfEvent::LlcMisses))
+        progress() << " llcMisses/load=" << static_cast<double>(perf[PerfEvent::LlcMisses]) / loadCount;
+      progress() << '\n';
+    }
+
+    ChaseLine* volatile sink = p; // keeps the chase alive
+    (void)sink;
+    return chrono::duration<double, nano>(t1 - t0).count() / loadCount;
+  });
+}
+
+// Sweeps the buffer size from 4 KiB to maxBytes in steps of 2x and 1.5x.
+void runLatencyTest(size_t maxBytes, Pages pages, const Sampling& sampling, vector<Record>& records) {
+  progress() << "\n\ntesting load latency via pointer chasing with " << pagesName(pages)
+             << " pages, up to " << (maxBytes >> 20) << " MiB\n";
+  for (size_t bytes = 4 * 1024; bytes <= maxBytes; bytes *= 2) {
+    for (size_t size : { bytes, bytes + bytes / 2 }) {
+      if (size > maxBytes)
+        break;
+      Record record;
+      record.mode = "latency";
+      record.kernel = "pointer-chase";
+      record.isa = "scalar";
+      record.threads = 1;
+      record.bytesPerThread = size;
+      record.placement = "first-touch";
+      record.pages = pagesName(pages);
+      record.unit = "ns/load";
+      record.stats = measureLoadLatency(size, pages, sampling, record.perf);
+      progress() << "measureLoadLatency(" << (size >> 10) << " KiB) => " << record.stats.median << " ns/load\n";
+      records.push_back(record);
+    }
+  }
 }
 
-int main() {
+// False sharing & cache line contention. Each thread increments its own
+// counter, with the counters either packed next to each other (so up to 8
+// threads share one cache line) or padded to 64 or 128 bytes (the latter
+// since adjacent-line prefetchers pull in pairs of lines). Increments are
+// either plain load+add+store or atomic fetch_add. The 'shared' layout has
+// all threads fetch_add the very same counter.
+struct ContentionTest {
+  const char* name;
+  size_t stride; // bytes between the counters of neighboring threads, 0 for one shared counter
+  bool atomicIncrement;
+};
+
+const ContentionTest contentionTests[] = {
+  { "packed-plain", sizeof(uint64_t), false },
+  { "packed-atomic", sizeof(uint64_t), true },
+  { "pad64-plain", 64, false },
+  { "pad64-atomic", 64, true },
+  { "pad128-plain", 128, false },
+  { "pad128-atomic", 128, true },
+  { "shared-fetch_add", 0, true },
+};
 
-  auto runTest = [](int workAreaSize, int maxThreadN)
-  {
-    cout << "\n\ntesting with workAreaSize=" << workAreaSize << '\n';
-    for (int threadN = 1; threadN<=maxThreadN; threadN*=2)
-      computeMegaflops(threadN, workAreaSize);
+// @return million increments per second summed over all threads
+// @param perf receives the hw counters of all threads' increment loops, with --perf
+double computeIncrementRate(const ContentionTest& test, int threadN, bool pinThreads, int durationMs, PerfCounts& perf) {
+  typedef atomic<uint64_t> Counter;
+  static const vector<int> cpus = readNumaTopology().allCpus();
+
+  // counters live at base + i*stride in a 128-byte aligned buffer
+  vector<char> buffer(max<size_t>(test.stride, sizeof(Counter)) * threadN + 128);
+  char* base = buffer.data() + (128 - reinterpret_cast<uintptr_t>(buffer.data()) % 128);
+  vector<Counter*> counters;
+  for (int i=0; i<threadN; ++i)
+    counters.push_back(new (base + i * test.stride) Counter(0));
+
+  atomic<int> readyCount(0);
+  atomic<bool> go(false), stop(false);
+  vector<thread> threads;
+  vector<PerfCounts> threadPerf(threadN);
+  vector<exception_ptr> pinErrors(threadN);
+  for (int i=0; i<threadN; ++i) {
+    Counter* counter = counters[i];
+    int cpu = cpus[i % cpus.size()];
+    bool atomicIncrement = test.atomicIncrement;
+    PerfCounts* perfCounts = &threadPerf[i];
+    exception_ptr* pinError = &pinErrors[i];
+    threads.push_back(thread([counter, cpu, pinThreads, atomicIncrement, perfCounts, pinError, &readyCount, &go, &stop]() {
+      if (pinThreads) {
+        try {
+          pinThisThread(cpu);
+        }
+        catch (...) { // rethrown by the main thread, escaping here would terminate
+          *pinError = current_exception();
+          ++readyCount;
+          return;
+        }
+      }
+      auto perfCounters = openPerfCounters();
+      ++readyCount;
+      while (!go.load())
+        this_thread::yield();
+      if (perfCounters)
+        perfCounters->start();
+      const int batchN = 1024; // increments between checks of the stop flag
+      while (!stop.load(memory_order_relaxed)) {
+        if (atomicIncrement) {
+          for (int j=0; j<batchN; ++j)
+            counter->fetch_add(1);
+        }
+        else {
+          // relaxed load & store compile to a plain, non-atomic read-modify-write
+          for (int j=0; j<batchN; ++j)
+            counter->store(counter->load(memory_order_relaxed) + 1, memory_order_relaxed);
+        }
+      }
+      if (perfCounters)
+        *perfCounts = perfCounters->stop();
+    }));
+  }
+  while (readyCount.load() < threadN)
+    this_thread::yield();
+
+  auto t0 = chrono::steady_clock::now();
+  go = true;
+  this_thread::sleep_for(chrono::milliseconds(durationMs));
+  stop = true;
+  for (auto& t : threads)
+    t.join();
+  auto totalTime = chrono::duration<double>(chrono::steady_clock::now() - t0);
+  for (const auto& error : pinErrors)
+    if (error)
+      rethrow_exception(error);
+
+  // the shared counter sums itself up, the others are summed here
+  double totalIncrements = 0;
+  for (int i=0; i<(test.stride == 0 ? 1 : threadN); ++i)
+    totalIncrements += static_cast<double>(counters[i]->load());
+  auto megaOpsPerSec = totalIncrements / totalTime.count() / 1e6;
+  progress() << "computeIncrementRate(" << test.name << ", " << threadN << ") => "
+    << megaOpsPerSec << " Mops/s, " << 1000.0 * threadN / megaOpsPerSec << " ns/op per thread\n";
+  perf = PerfCounts();
+  for (const auto& p : threadPerf)
+    perf += p;
+  if (perfEnabled) {
+    progress() << "  perf: " << perf.summary();
+    if (perf.has(PerfEvent::Cycles) && totalIncrements > 0)
+      progress() << " cycles/op=" << perf[PerfEvent::Cycles] / totalIncrements;
+    progress() << '\n';
+  }
+  return megaOpsPerSec;
+}
+
+// Sweeps thread counts 1, 2, 4, ... up to the number of logical cpus (and
+// that count itself if it's no power of 2), oversubscribed on a single cpu.
+void runContentionTest(bool pinThreads, const Sampling& sampling, vector<Record>& records) {
+  const int cpuN = max(1u, thread::hardware_concurrency());
+  vector<int> threadNs;
+  for (int threadN = 1; threadN < cpuN; threadN *= 2)
+    threadNs.push_back(threadN);
+  threadNs.push_back(cpuN);
+  if (cpuN == 1)
+    threadNs.push_back(2); // otherwise there's nothing to contend
+
+  for (const auto& test : contentionTests) {
+    progress() << "\n\ntesting contention for " << test.name << '\n';
+    for (int threadN : threadNs) {
+      Record record;
+      record.mode = "contention";
+      record.kernel = test.name;
+      record.isa = "scalar";
+      record.threads = threadN;
+      record.bytesPerThread = test.stride;
+      record.placement = pinThreads ? "pinned" : "unpinned";
+      record.unit = "Mops/s";
+      record.stats = repeatRun(sampling, [&]() {
+        return computeIncrementRate(test, threadN, pinThreads, sampling.durationMs, record.perf);
+      });
+      records.push_back(record);
+    }
+  }
+}
+
+bool startsWith(const string& s, const string& prefix) {
+  return s.compare(0, prefix.size(), prefix) == 0;
+}
+
+const size_t maxPrefetchBytes = size_t(1) << 20; // way beyond any useful distance
+
+// parses --prefetch's '0,256,1024', returns false on anything else (like
+// the cpu list ranges of parseIdList())
+bool parsePrefetchDistances(const string& list, vector<size_t>& distances) {
+  distances.clear();
+  stringstream ss(list);
+  string item;
+  while (getline(ss, item, ',')) {
+    if (item.empty() || item.size() > 7 || item.find_first_not_of("0123456789") != string::npos)
+      return false;
+    const size_t bytes = stoul(item);
+    if (bytes > maxPrefetchBytes)
+      return false;
+    distances.push_back(bytes);
+  }
+  return !distances.empty() && list.back() != ',';
+}
+
+// Host metadata written along with the json/csv results, so that results
+// from before and after a kernel or BIOS upgrade can be diffed.
+vector<pair<string, string>> readHostInfo() {
+  vector<pair<string, string>> info;
+  auto readLine = [](const string& path) {
+    ifstream in(path);
+    string line;
+    getline(in, line);
+    return line;
   };
 
-  runTest(10, 128);
-  runTest(1000, 32);
-  runTest(1000 * 1000, 32);
+#ifdef __linux__
+  char hostname[256] = {};
+  gethostname(hostname, sizeof(hostname) - 1);
+  info.push_back(make_pair("hostname", string(hostname)));
+  struct utsname uts;
+  if (uname(&uts) == 0)
+    info.push_back(make_pair("os", string(uts.sysname) + " " + uts.release + " " + uts.version));
+#endif
+
+  string cpuModel;
+  ifstream cpuinfo("/proc/cpuinfo");
+  for (string line; cpuModel.empty() && getline(cpuinfo, line); )
+    if (startsWith(line, "model name"))
+      cpuModel = line.substr(line.find(':') + 2);
+  info.push_back(make_pair("cpuModel", cpuModel));
+  info.push_back(make_pair("logicalCpus", to_string(thread::hardware_concurrency())));
+  info.push_back(make_pair("numaNodes", to_string(readNumaTopology().nodes.size())));
+
+  // e.g. 'L1d=48K L1i=32K L2=2048K L3=107520K', as seen by cpu0
+  string caches;
+  for (int index=0; ; ++index) {
+    const string dir = "/sys/devices/system/cpu/cpu0/cache/index" + to_string(index) + "/";
+    const string size = readLine(dir + "size");
+    if (size.empty())
+      break;
+    const string type = readLine(dir + "type");
+    const string suffix = type == "Data" ? "d" : type == "Instruction" ? "i" : "";
+    caches += (caches.empty() ? "" : " ") + ("L" + readLine(dir + "level") + suffix + "=" + size);
+  }
+  info.push_back(make_pair("caches", caches));
+  info.push_back(make_pair("thp", readLine("/sys/kernel/mm/transparent_hugepage/enabled")));
+  ostringstream tickRate;
+  tickRate << TickClock::get().ticksPerSec / 1e9 << " GHz, " << TickClock::get().overheadTicks << " ticks/read";
+  info.push_back(make_pair("tickClock", tickRate.str()));
+
+#if defined(__VERSION__)
+  info.push_back(make_pair("compiler", string(__VERSION__)));
+#elif defined(_MSC_VER)
+  info.push_back(make_pair("compiler", "msvc " + to_string(_MSC_VER)));
+#endif
+
+  char timestamp[32] = {};
+  time_t now = time(nullptr);
+  strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+  info.push_back(make_pair("timestamp", string(timestamp)));
+  return info;
+}
+
+string jsonString(const string& s) {
+  string escaped = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\')
+      escaped += string("\\") + c;
+    else if (static_cast<unsigned char>(c) < 0x20)
+      escaped += ' ';
+    else
+      escaped += c;
+  }
+  return escaped + "\"";
+}
+
+void writeJson(ostream& out, const vector<pair<string, string>>& hostInfo,
+               const Sampling& sampling, const vector<Record>& records) {
+  out << "{\n  \"host\": {";
+  for (size_t i=0; i<hostInfo.size(); ++i)
+    out << (i == 0 ? "\n" : ",\n") << "    " << jsonString(hostInfo[i].first) << ": " << jsonString(hostInfo[i].second);
+  out << "\n  },\n";
+  out << "  \"sampling\": { \"warmup\": " << sampling.warmup << ", \"repeat\": " << sampling.repeat
+      << ", \"durationMs\": " << sampling.durationMs << " },\n";
+  out << "  \"results\": [";
+  for (size_t i=0; i<records.size(); ++i) {
+    const auto& r = records[i];
+    out << (i == 0 ? "\n" : ",\n")
+        << "    { \"mode\": " << jsonString(r.mode) << ", \"kernel\": " << jsonString(r.kernel) << ", \"isa\": " << jsonString(r.isa)
+        << ", \"stores\": " << jsonString(r.nonTemporal ? "nt" : "regular") << ", \"prefetchBytes\": " << r.prefetchBytes
+        << ", \"threads\": " << r.threads << ", \"bytesPerThread\": " << r.bytesPerThread
+        << ", \"placement\": " << jsonString(r.placement) << ", \"pages\": " << jsonString(r.pages) << ", \"unit\": " << jsonString(r.unit)
+        << ", \"timerOverheadPct\": " << r.timerOverheadPct;
+    if (!r.perf.empty()) {
+      out << ", \"perf\": {";
+      const char* separator = " ";
+      for (int e=0; e<perfEventN; ++e) {
+        PerfEvent event = static_cast<PerfEvent>(e);
+        if (r.perf.has(event)) {
+          out << separator << jsonString(PerfCounts::name(event)) << ": " << r.perf[event];
+          separator = ", ";
+        }
+      }
+      out << " }";
+    }
+    out << ", \"samples\": [";
+    for (size_t j=0; j<r.stats.samples.size(); ++j)
+      out << (j == 0 ? "" : ", ") << r.stats.samples[j];
+    out << "], \"min\": " << r.stats.min << ", \"median\": " << r.stats.median << ", \"max\": " << r.stats.max
+        << ", \"mean\": " << r.stats.mean << ", \"stddev\": " << r.stats.stddev << " }";
+  }
+  out << "\n  ]\n}\n";
+}
+
+// host metadata goes into leading '#' comment lines
+void writeCsv(ostream& out, const vector<pair<string, string>>& hostInfo,
+              const Sampling& sampling, const vector<Record>& records) {
+  for (const auto& kv : hostInfo)
+    out << "# " << kv.first << ": " << kv.second << '\n';
+  out << "# warmup: " << sampling.warmup << "\n# repeat: " << sampling.repeat
+      << "\n# durationMs: " << sampling.durationMs << '\n';
+  out << "mode,kernel,isa,stores,prefetchBytes,threads,bytesPerThread,placement,pages,unit,timerOverheadPct,repeat,min,median,max,mean,stddev";
+  for (int e=0; e<perfEventN; ++e)
+    out << ',' << PerfCounts::name(static_cast<PerfEvent>(e));
+  out << '\n';
+  for (const auto& r : records) {
+    out << r.mode << ',' << r.kernel << ',' << r.isa << ',' << (r.nonTemporal ? "nt" : "regular") << ',' << r.prefetchBytes << ',' << r.threads << ',' << r.bytesPerThread << ','
+        << r.placement << ',' << r.pages << ',' << r.unit << ',' << r.timerOverheadPct << ',' << r.stats.samples.size() << ','
+        << r.stats.min << ',' << r.stats.median << ',' << r.stats.max << ','
+        << r.stats.mean << ',' << r.stats.stddev;
+    for (int e=0; e<perfEventN; ++e) { // empty if unavailable
+      out << ',';
+      if (r.perf.has(static_cast<PerfEvent>(e)))
+        out << r.perf[static_cast<PerfEvent>(e)];
+    }
+    out << '\n';
+  }
+}
+
+// usage: MemBandwidthTest [options] [kernel...]
+//   e.g. 'MemBandwidthTest copy triad', 'all' for every kernel. Runs just
+//   the original increment sweep if no kernel is given, unless --latency,
+//   --numa-matrix or --contention asked for just that.
+// options:
+//   --latency                  run the pointer-chasing latency sweep
+//   --latency-max-mib=N        largest latency buffer, implies --latency
+//   --pin                      pin each worker thread to its own cpu
+//   --worker-first-touch       workers allocate & init their own work areas
+//   --placement=P              P is local, remote or interleave, implies --pin
+//   --numa-matrix              cpu node x memory node bandwidth matrix
+//   --pages=P                  P is default, 4k, thp, 2m, 1g (hugetlbfs) or all, for both
+//                              the work areas and the latency buffer
+//   --contention               false sharing & shared counter scaling, honors --pin
+//   --perf                     cycles, instructions, LLC & dTLB misses and backend stalls
+//                              of each measured region via perf_event_open (Linux)
+//   --repeat=N                 measure each configuration N times (default 1)
+//   --warmup=N                 extra runs before those that get discarded (default 0)
+//   --duration-ms=N            length of each bandwidth run (default 1000)
+//   --isa=I                    kernel variant: auto (compiler vectorized), sse2, avx2,
+//                              avx512 or all. Default is the widest one the cpu supports
+//   --store=S                  S is regular (default), nt (streaming stores) or all
+//   --prefetch=D[,D...]        software prefetch distances in bytes (up to 1 MiB) to sweep, 0 for none
+//   --format=F                 F is text (default), json or csv
+//   --output=FILE              write json/csv to FILE instead of stdout
+int main(int argc, char** argv) {
+
+  bool runLatency = false;
+  bool runMatrix = false;
+  bool runContention = false;
+  Placement placement;
+  Sampling sampling;
+  string format = "text";
+  string outputPath;
+  vector<const IsaInfo*> isas;
+  vector<bool> storeModes(1, false); // nonTemporal
+  vector<Pages> pageSizes(1, Pages::Default);
+  vector<size_t> prefetchDistances(1, 0);
+  size_t latencyMaxBytes = size_t(4) << 30;
+#ifdef __linux__
+  // don't let the default sweep push the box into swap
+  latencyMaxBytes = min<size_t>(latencyMaxBytes,
+    static_cast<size_t>(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGESIZE) / 2);
+#endif
+
+  vector<const KernelInfo*> kernels;
+  for (int i=1; i<argc; ++i) {
+    const string arg = argv[i];
+    const string latencyMaxPrefix = "--latency-max-mib=";
+    const string placementPrefix = "--placement=";
+    auto intValue = [&arg]() { return max(0, atoi(arg.c_str() + arg.find('=') + 1)); };
+    if (arg == "--latency") {
+      runLatency = true;
+    }
+    else if (startsWith(arg, latencyMaxPrefix)) {
+      runLatency = true;
+      latencyMaxBytes = strtoull(arg.c_str() + latencyMaxPrefix.size(), nullptr, 10) << 20;
+    }
+    else if (arg == "--pin") {
+      placement.pinThreads = true;
+    }
+    else if (arg == "--worker-first-touch") {
+      placement.workerFirstTouch = true;
+    }
+    else if (startsWith(arg, placementPrefix)) {
+      const string policy = arg.substr(placementPrefix.size());
+      if (policy == "local")
+        placement.memPolicy = MemPolicy::Local;
+      else if (policy == "remote")
+        placement.memPolicy = MemPolicy::Remote;
+      else if (policy == "interleave")
+        placement.memPolicy = MemPolicy::Interleave;
+      else {
+        cerr << "unknown placement '" << policy << "', expected local, remote or interleave\n";
+        return 1;
+      }
+      placement.pinThreads = true; // local/remote are relative to the worker's cpu
+    }
+    else if (arg == "--numa-matrix") {
+      runMatrix = true;
+    }
+    else if (arg == "--contention") {
+      runContention = true;
+    }
+    else if (arg == "--perf") {
+      perfEnabled = true;
+    }
+    else if (startsWith(arg, "--repeat=")) {
+      sampling.repeat = max(1, intValue());
+    }
+    else if (startsWith(arg, "--warmup=")) {
+      sampling.warmup = intValue();
+    }
+    else if (startsWith(arg, "--duration-ms=")) {
+      sampling.durationMs = max(1, intValue());
+    }
+    else if (startsWith(arg, "--format=")) {
+      format = arg.substr(arg.find('=') + 1);
+      if (format != "text" && format != "json" && format != "csv") {
+        cerr << "unknown format '" << format << "', expected text, json or csv\n";
+        return 1;
+      }
+    }
+    else if (startsWith(arg, "--isa=")) {
+      const string name = arg.substr(arg.find('=') + 1);
+      for (const auto& info : isaInfos)
+        if ((name == "all" || name == info.name) && isSupported(info))
+          isas.push_back(&info);
+      if (name != "all" && isas.empty()) {
+        auto isa = findIsa(name);
+        cerr << (isa == nullptr ? "unknown isa '" : "cpu does not support isa '") << name << "', expected one of:";
+        for (const auto& info : isaInfos)
+          if (isSupported(info))
+            cerr << ' ' << info.name;
+        cerr << " all\n";
+        return 1;
+      }
+    }
+    else if (startsWith(arg, "--pages=")) {
+      const string name = arg.substr(arg.find('=') + 1);
+      pageSizes.clear();
+      for (const auto& info : pagesInfos)
+        if (name == "all" || name == info.name)
+          pageSizes.push_back(info.pages);
+      if (pageSizes.empty()) {
+        cerr << "unknown page size '" << name << "', expected one of:";
+        for (const auto& info : pagesInfos)
+          cerr << ' ' << info.name;
+        cerr << " all\n";
+        return 1;
+      }
+    }
+    else if (startsWith(arg, "--store=")) {
+      const string mode = arg.substr(arg.find('=') + 1);
+      if (mode == "regular" || mode == "nt")
+        storeModes.assign(1, mode == "nt");
+      else if (mode == "all")
+        storeModes = { false, true };
+      else {
+        cerr << "unknown store mode '" << mode << "', expected regular, nt or all\n";
+        return 1;
+      }
+    }
+    else if (startsWith(arg, "--prefetch=")) {
+      const string list = arg.substr(arg.find('=') + 1);
+      if (!parsePrefetchDistances(list, prefetchDistances)) {
+        cerr << "bad prefetch distances '" << list << "', expected a comma separated list of byte distances up to "
+             << maxPrefetchBytes << ", 0 for none, e.g. --prefetch=0,256,1024\n";
+        return 1;
+      }
+    }
+    else if (startsWith(arg, "--output=")) {
+      outputPath = arg.substr(arg.find('=') + 1);
+    }
+    else if (arg == "all") {
+      for (const auto& info : kernelInfos)
+        kernels.push_back(&info);
+    }
+    else {
+      auto kernel = findKernel(arg);
+      if (kernel == nullptr) {
+        cerr << "unknown kernel '" << argv[i] << "', expected one of:";
+        for (const auto& info : kernelInfos)
+          cerr << ' ' << info.name;
+        cerr << " all\n";
+        return 1;
+      }
+      kernels.push_back(kernel);
+    }
+  }
+  if (placement.memPolicy == MemPolicy::Remote && readNumaTopology().nodes.size() < 2) {
+    cerr << "--placement=remote needs at least 2 NUMA nodes, this box has 1\n";
+    return 1;
+  }
+  if (format != "text" && outputPath.empty())
+    progressStream = &cerr;
+  if (isas.empty())
+    isas.push_back(&bestIsa());
+  vector<KernelVariant> variants;
+  for (auto isa : isas) {
+    for (bool nonTemporal : storeModes) {
+      for (size_t prefetchBytes : prefetchDistances) {
+        KernelVariant variant = { isa, nonTemporal, prefetchBytes };
+        if (variant.func() != nullptr)
+          variants.push_back(variant);
+        else
+          progress() << "skipping " << variant.name() << ", needs explicit SIMD\n";
+      }
+    }
+  }
+
+  // probe every page size up front, a hugetlbfs pool that is not reserved would
+  // otherwise only fail inside a worker thread
+  for (auto it = pageSizes.begin(); it != pageSizes.end(); ) {
+    try {
+      Mapping probe;
+      probe.map(1, *it, vector<int>());
+      ++it;
+    }
+    catch (const runtime_error& e) {
+      if (pageSizes.size() == 1) {
+        cerr << e.what() << '\n';
+        return 1;
+      }
+      progress() << "skipping " << pagesName(*it) << " pages: " << e.what() << '\n';
+      it = pageSizes.erase(it);
+    }
+  }
+
+  vector<Record> records;
+  try {
+    if (runMatrix) {
+      for (auto kernel : kernels.empty() ? vector<const KernelInfo*>(1, findKernel("triad")) : kernels)
+        for (const auto& variant : variants)
+          for (auto pages : pageSizes)
+            runNumaMatrix(*kernel, variant, 1000 * 1000, pages, sampling, records);
+      kernels.clear(); // the matrix replaces the regular sweep
+    }
+    else if (kernels.empty() && !runLatency && !runContention) {
+      // the baseline's sweep, about 20s. All kernels (x --isa=all x --store=all)
+      // take minutes, so those are opt-in.
+      kernels.push_back(findKernel("increment"));
+    }
+
+    auto runTest = [&placement, &sampling, &records](const KernelInfo& kernel, const KernelVariant& variant, int workAreaSize, int maxThreadN)
+    {
+      progress() << "\n\ntesting " << kernel.name << "/" << variant.name() << " with workAreaSize=" << workAreaSize
+                 << " and " << pagesName(placement.pages) << " pages\n";
+      for (int threadN = 1; threadN<=maxThreadN; threadN*=2)
+        records.push_back(measureBandwidth(kernel, variant, threadN, workAreaSize, placement, sampling));
+    };
+
+    for (auto pages : pageSizes) {
+      placement.pages = pages;
+      for (auto kernel : kernels) {
+        for (const auto& variant : variants) {
+          runTest(*kernel, variant, 10, 128);
+          runTest(*kernel, variant, 1000, 32);
+          runTest(*kernel, variant, 1000 * 1000, 32);
+        }
+      }
+    }
+
+    if (runLatency)
+      for (auto pages : pageSizes)
+        runLatencyTest(latencyMaxBytes, pages, sampling, records);
+
+    if (runContention)
+      runContentionTest(placement.pinThreads, sampling, records);
+  }
+  catch (const exception& e) { // e.g. pinning to a cpu we may not run on
+    cerr << e.what() << '\n';
+    return 1;
+  }
+
+  if (format != "text") {
+    ofstream file;
+    if (!outputPath.empty()) {
+      file.open(outputPath);
+      if (!file) {
+        cerr << "cannot write " << outputPath << '\n';
+        return 1;
+      }
+    }
+    ostream& out = outputPath.empty() ? cout : file;
+    out << setprecision(6);
+    if (format == "json")
+      writeJson(out, readHostInfo(), sampling, records);
+    else
+      writeCsv(out, readHostInfo(), sampling, records);
+  }
 
   return 0;
-}
\ No newline at end of file
+}
@@ -4,7 +4,8 @@
     {
       "target_name": "MemBandwidthTest",
       "type": "executable",
-      "sources": [ "MemBandwidthTest.cpp" ]
+      "sources": [ "MemBandwidthTest.cpp" ],
+      "include_dirs": [ "../src" ]
     }
   ]
 }
\ No newline at end of file
@@ -28,6 +28,7 @@
                #'-std=c++14', # should have worked for clang 3.5 but didnt
                '-std=c++1y',
                #'-std=c++1z',
+               #'-std=c++20', # for src/coroutine.cpp, which is a stub otherwise
               
                # to use clang's libc++ instead of the gcc default (for <codecvt> mostly):
                '-stdlib=libc++'
@@ -38,9 +39,12 @@
                 'src/locale.cpp',
                 'src/main.cpp',
                 'src/move.cpp',
+                'src/alloc_tracker.cpp',
                 'src/stl.cpp',
+                'src/pool_allocator.cpp',
                 'src/mpl.cpp',
                 'src/threading.cpp',
+                'src/coroutine.cpp',
                 'src/variadic_template_func.cpp',
             ],
             'libraries': [
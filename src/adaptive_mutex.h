@@ -0,0 +1,247 @@
+// Mutex that spins for a while before parking on a futex, with optional
+// lock statistics.
+//
+// The spin budget adapts per mutex, glibc's PTHREAD_MUTEX_ADAPTIVE_NP
+// style: it tracks how long spinning typically took to get the lock and
+// spins up to about twice that, so locks that are held long stop wasting
+// cycles on spinning. On a single cpu it doesn't spin at all, since the
+// owner can't run meanwhile anyway. Parking is the 3-state futex mutex of
+// Drepper's "Futexes Are Tricky" (0 unlocked, 1 locked, 2 locked with
+// waiters), so unlock only makes a syscall if someone is parked. Off Linux
+// parking degrades to yielding.
+//
+// A mutex constructed with a name collects stats: acquisition & contended
+// counts plus log2 histograms of the wait time of contended acquisitions
+// and of hold times. These are updated while holding the lock, so they need
+// no atomics. Stats get merged by name when a mutex dies and are dumped to
+// cerr at exit, so they also cover short-lived mutexes like the ones in
+// benchmarkQueues(). See benchmarkMutexes() in threading.cpp.
+//
+// Satisfies Lockable, i.e. works with lock_guard, unique_lock and (unlike
+// std::condition_variable, which insists on std::mutex)
+// std::condition_variable_any.
+
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <cstdint>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <map>
+#include <string>
+#include <memory>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h> // _mm_pause
+#endif
+
+struct LockStats {
+  static const int bucketN = 40; // bucket i counts [2^i, 2^(i+1)) ns, 0 goes into bucket 0
+
+  LockStats() : acquisitions(0), contended(0) {
+    waitNs.fill(0);
+    holdNs.fill(0);
+  }
+
+  static void record(std::array<uint64_t, bucketN>& histogram, uint64_t ns) {
+    int bucket = 0;
+    while (ns > 1 && bucket < bucketN - 1) {
+      ns >>= 1;
+      ++bucket;
+    }
+    ++histogram[bucket];
+  }
+
+  void merge(const LockStats& rhs) {
+    acquisitions += rhs.acquisitions;
+    contended += rhs.contended;
+    for (int i=0; i<bucketN; ++i) {
+      waitNs[i] += rhs.waitNs[i];
+      holdNs[i] += rhs.holdNs[i];
+    }
+  }
+
+  void print(std::ostream& out, const std::string& name) const {
+    out << "  " << name << ": " << acquisitions << " acquisitions, " << contended << " contended ("
+        << std::fixed << std::setprecision(1) << (acquisitions == 0 ? 0.0 : 100.0 * contended / acquisitions) << "%)\n";
+    out.unsetf(std::ios::floatfield);
+    printHistogram(out, "wait (contended)", waitNs);
+    printHistogram(out, "hold", holdNs);
+  }
+
+  uint64_t acquisitions;
+  uint64_t contended; // didn't get the lock on the first try
+  std::array<uint64_t, bucketN> waitNs;
+  std::array<uint64_t, bucketN> holdNs;
+
+  private:
+    // e.g. "hold ns: 64:12 128:300 1k:2", buckets by lower bound
+    static void printHistogram(std::ostream& out, const char* title, const std::array<uint64_t, bucketN>& histogram) {
+      out << "    " << title << " ns:";
+      for (int i=0; i<bucketN; ++i) {
+        if (histogram[i] == 0)
+          continue;
+        uint64_t from = i == 0 ? 0 : uint64_t(1) << i;
+        const char* suffix = "";
+        if (from >= (uint64_t(1) << 30)) { from >>= 30; suffix = "G"; }
+        else if (from >= (uint64_t(1) << 20)) { from >>= 20; suffix = "M"; }
+        else if (from >= (uint64_t(1) << 10)) { from >>= 10; suffix = "k"; }
+        out << ' ' << from << suffix << ':' << histogram[i];
+      }
+      out << '\n';
+    }
+};
+
+// stats of all named mutexes, by name, dumped at exit
+class LockStatsRegistry {
+  public:
+    static LockStatsRegistry& instance() {
+      static LockStatsRegistry registry;
+      return registry;
+    }
+
+    void merge(const std::string& name, const LockStats& stats) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stats_[name].merge(stats);
+    }
+
+    ~LockStatsRegistry() {
+      if (stats_.empty())
+        return;
+      std::cerr << "lock stats:\n";
+      for (const auto& entry : stats_)
+        entry.second.print(std::cerr, entry.first);
+    }
+
+  private:
+    std::mutex mutex_;
+    std::map<std::string, LockStats> stats_;
+};
+
+class AdaptiveMutex {
+  public:
+    // a name turns on stats, see LockStats
+    explicit AdaptiveMutex(const char* name = nullptr) : state_(0), spinEstimate_(0) {
+      if (name != nullptr) {
+        LockStatsRegistry::instance(); // make sure it outlives this
+        name_ = name;
+        stats_.reset(new LockStats);
+      }
+    }
+
+    ~AdaptiveMutex() {
+      if (stats_)
+        LockStatsRegistry::instance().merge(name_, *stats_);
+    }
+
+    void lock() {
+      int expected = 0;
+      if (state_.compare_exchange_strong(expected, 1, std::memory_order_acquire)) {
+        if (stats_)
+          acquired(false, Clock::time_point());
+        return;
+      }
+      lockContended();
+    }
+
+    bool try_lock() {
+      int expected = 0;
+      if (!state_.compare_exchange_strong(expected, 1, std::memory_order_acquire))
+        return false;
+      if (stats_)
+        acquired(false, Clock::time_point());
+      return true;
+    }
+
+    void unlock() {
+      if (stats_)
+        LockStats::record(stats_->holdNs, nsSince(lockedAt_));
+      if (state_.exchange(0, std::memory_order_release) == 2)
+        wake();
+    }
+
+  private:
+    AdaptiveMutex(const AdaptiveMutex&); // = delete, but vs2012
+    AdaptiveMutex& operator=(const AdaptiveMutex&);
+
+    typedef std::chrono::steady_clock Clock;
+
+    static uint64_t nsSince(Clock::time_point t) {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t).count();
+    }
+
+    static void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+      _mm_pause();
+#endif
+    }
+
+    // under the lock from here on
+    void acquired(bool contended, Clock::time_point waitStart) {
+      ++stats_->acquisitions;
+      if (contended) {
+        ++stats_->contended;
+        LockStats::record(stats_->waitNs, nsSince(waitStart));
+      }
+      lockedAt_ = Clock::now();
+    }
+
+    void lockContended() {
+      Clock::time_point waitStart;
+      if (stats_)
+        waitStart = Clock::now();
+
+      static const int maxSpinN = std::thread::hardware_concurrency() > 1 ? 1000 : 0;
+      const int estimate = spinEstimate_.load(std::memory_order_relaxed);
+      const int spinN = std::min(maxSpinN, 2 * estimate + 10);
+      for (int spin=0; spin<spinN; ++spin) {
+        cpuRelax();
+        int expected = 0;
+        if (state_.load(std::memory_order_relaxed) == 0
+            && state_.compare_exchange_weak(expected, 1, std::memory_order_acquire)) {
+          spinEstimate_.store(estimate + (spin - estimate) / 8, std::memory_order_relaxed);
+          if (stats_)
+            acquired(true, waitStart);
+          return;
+        }
+      }
+      if (maxSpinN != 0)
+        spinEstimate_.store(estimate + (spinN - estimate) / 8, std::memory_order_relaxed);
+
+      // mark as contended, so that the unlock wakes us
+      while (state_.exchange(2, std::memory_order_acquire) != 0)
+        wait();
+      if (stats_)
+        acquired(true, waitStart);
+    }
+
+    // sleeps while state_ is still 2
+    void wait() {
+#ifdef __linux__
+      syscall(SYS_futex, &state_, FUTEX_WAIT_PRIVATE, 2, nullptr, nullptr, 0);
+#else
+      std::this_thread::yield();
+#endif
+    }
+
+    void wake() {
+#ifdef __linux__
+      syscall(SYS_futex, &state_, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+    }
+
+    std::atomic<int> state_; // 0 unlocked, 1 locked, 2 locked & maybe waiters
+    std::atomic<int> spinEstimate_;
+    std::string name_;
+    std::unique_ptr<LockStats> stats_;
+    Clock::time_point lockedAt_; // for the hold time, owner only
+};
@@ -0,0 +1,212 @@
+// Replaces the global operator new & delete, see alloc_tracker.h.
+//
+// Each block gets a 16 byte header holding its size, since unsized delete
+// needs it for the byte counts (and malloc_usable_size() is glibc only).
+// 16 keeps the alignment malloc guarantees. Aligned new (C++17) isn't
+// replaced and so not counted.
+
+#include "alloc_tracker.h"
+
+#include <cstdlib>
+#include <new>
+#include <atomic>
+#include <algorithm>
+#include <iostream>
+#ifdef __GNUG__
+#include <cxxabi.h> // abi::__cxa_demangle
+#endif
+
+using namespace std;
+
+namespace {
+
+const size_t headerSize = 16;
+
+// plain struct, so that thread_local needs no dynamic init which could
+// itself allocate
+thread_local AllocCounts threadCounts = { 0, 0, 0, 0, 0, 0 };
+
+struct ProcessCounts {
+  atomic<uint64_t> allocN;
+  atomic<uint64_t> freeN;
+  atomic<uint64_t> allocBytes;
+  atomic<uint64_t> freeBytes;
+  atomic<int64_t> liveBytes;
+  atomic<int64_t> peakLiveBytes;
+};
+ProcessCounts processCounts; // zero-initialized before any dynamic init
+
+void countAlloc(size_t size) {
+  AllocCounts& counts = threadCounts;
+  ++counts.allocN;
+  counts.allocBytes += size;
+  counts.liveBytes += size;
+  counts.peakLiveBytes = max(counts.peakLiveBytes, counts.liveBytes);
+
+  processCounts.allocN.fetch_add(1, memory_order_relaxed);
+  processCounts.allocBytes.fetch_add(size, memory_order_relaxed);
+  const int64_t live = processCounts.liveBytes.fetch_add(size, memory_order_relaxed) + size;
+  int64_t peak = processCounts.peakLiveBytes.load(memory_order_relaxed);
+  while (live > peak && !processCounts.peakLiveBytes.compare_exchange_weak(peak, live, memory_order_relaxed)) {}
+}
+
+void countFree(size_t size) {
+  AllocCounts& counts = threadCounts;
+  ++counts.freeN;
+  counts.freeBytes += size;
+  counts.liveBytes -= size;
+
+  processCounts.freeN.fetch_add(1, memory_order_relaxed);
+  processCounts.freeBytes.fetch_add(size, memory_order_relaxed);
+  processCounts.liveBytes.fetch_sub(size, memory_order_relaxed);
+}
+
+void* trackedAlloc(size_t size) {
+  char* block = static_cast<char*>(malloc(headerSize + size));
+  if (block == nullptr)
+    return nullptr;
+  *reinterpret_cast<size_t*>(block) = size;
+  countAlloc(size);
+  return block + headerSize;
+}
+
+// operator new's loop: retry after the new handler, throw if there is none
+void* trackedNew(size_t size) {
+  for (;;) {
+    if (void* p = trackedAlloc(size))
+      return p;
+    new_handler handler = get_new_handler();
+    if (handler == nullptr)
+      throw bad_alloc();
+    handler();
+  }
+}
+
+void trackedFree(void* p) {
+  if (p == nullptr)
+    return;
+  char* block = static_cast<char*>(p) - headerSize;
+  countFree(*reinterpret_cast<size_t*>(block));
+  free(block);
+}
+
+}
+
+void* operator new(size_t size) { return trackedNew(size); }
+void* operator new[](size_t size) { return trackedNew(size); }
+void* operator new(size_t size, const nothrow_t&) noexcept {
+  try { return trackedNew(size); } catch (...) { return nullptr; }
+}
+void* operator new[](size_t size, const nothrow_t&) noexcept {
+  try { return trackedNew(size); } catch (...) { return nullptr; }
+}
+void operator delete(void* p) noexcept { trackedFree(p); }
+void operator delete[](void* p) noexcept { trackedFree(p); }
+void operator delete(void* p, size_t) noexcept { trackedFree(p); }
+void operator delete[](void* p, size_t) noexcept { trackedFree(p); }
+void operator delete(void* p, const nothrow_t&) noexcept { trackedFree(p); }
+void operator delete[](void* p, const nothrow_t&) noexcept { trackedFree(p); }
+
+AllocCounts threadAllocCounts() {
+  return threadCounts;
+}
+
+AllocCounts processAllocCounts() {
+  AllocCounts counts = {
+    processCounts.allocN.load(memory_order_relaxed),
+    processCounts.freeN.load(memory_order_relaxed),
+    processCounts.allocBytes.load(memory_order_relaxed),
+    processCounts.freeBytes.load(memory_order_relaxed),
+    processCounts.liveBytes.load(memory_order_relaxed),
+    processCounts.peakLiveBytes.load(memory_order_relaxed),
+  };
+  return counts;
+}
+
+TypeOpCounts*& threadTypeOpCountsHead() {
+  static thread_local TypeOpCounts* head = nullptr;
+  return head;
+}
+
+string typeName(const type_info& type) {
+#ifdef __GNUG__
+  int status = 0;
+  char* demangled = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+  if (status == 0 && demangled != nullptr) {
+    string name(demangled);
+    free(demangled);
+    return name;
+  }
+#endif
+  return type.name();
+}
+
+TrackingStats::TypeOps TrackingStats::find(const type_info& type) const {
+  for (const TypeOps& ops : typeOps)
+    if (*ops.type == type)
+      return ops;
+  TypeOps none = { &type, 0, 0 };
+  return none;
+}
+
+// "3 allocs (112 bytes), 3 frees, peak +112 bytes, copies: A=2, moves: A=1"
+void TrackingStats::print(ostream& out) const {
+  out << allocN << " allocs (" << allocBytes << " bytes), " << freeN << " frees, peak +" << peakLiveBytes << " bytes";
+  const char* separator = ", copies: ";
+  for (const TypeOps& ops : typeOps)
+    if (ops.copyN != 0) {
+      out << separator << typeName(*ops.type) << '=' << ops.copyN;
+      separator = " ";
+    }
+  separator = ", moves: ";
+  for (const TypeOps& ops : typeOps)
+    if (ops.moveN != 0) {
+      out << separator << typeName(*ops.type) << '=' << ops.moveN;
+      separator = " ";
+    }
+}
+
+TrackingRegion::TrackingRegion(const char* name, bool reportAtEnd)
+    : name_(name), reportAtEnd_(reportAtEnd), outerPeakLiveBytes_(threadCounts.peakLiveBytes) {
+  reset();
+}
+
+TrackingRegion::~TrackingRegion() {
+  if (reportAtEnd_) {
+    cout << name_ << ": ";
+    stats().print(cout);
+    cout << '\n';
+  }
+  threadCounts.peakLiveBytes = max(threadCounts.peakLiveBytes, outerPeakLiveBytes_);
+}
+
+void TrackingRegion::reset() {
+  typeOpsStart_.clear();
+  for (TypeOpCounts* counts = threadTypeOpCountsHead(); counts != nullptr; counts = counts->next)
+    typeOpsStart_.push_back(*counts);
+  // after the allocations above
+  outerPeakLiveBytes_ = max(outerPeakLiveBytes_, threadCounts.peakLiveBytes);
+  threadCounts.peakLiveBytes = threadCounts.liveBytes;
+  start_ = threadCounts;
+}
+
+TrackingStats TrackingRegion::stats() const {
+  const AllocCounts now = threadCounts;
+  TrackingStats stats;
+  stats.allocN = now.allocN - start_.allocN;
+  stats.freeN = now.freeN - start_.freeN;
+  stats.allocBytes = now.allocBytes - start_.allocBytes;
+  stats.freeBytes = now.freeBytes - start_.freeBytes;
+  stats.peakLiveBytes = now.peakLiveBytes - start_.liveBytes;
+  for (TypeOpCounts* counts = threadTypeOpCountsHead(); counts != nullptr; counts = counts->next) {
+    TrackingStats::TypeOps ops = { counts->type, counts->copyN, counts->moveN };
+    for (const TypeOpCounts& start : typeOpsStart_)
+      if (start.type == counts->type) {
+        ops.copyN -= start.copyN;
+        ops.moveN -= start.moveN;
+      }
+    if (ops.copyN != 0 || ops.moveN != 0)
+      stats.typeOps.push_back(ops);
+  }
+  return stats;
+}
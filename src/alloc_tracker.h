@@ -0,0 +1,122 @@
+// Allocation & copy/move accounting, i.e. A::copyCount in move.cpp for any
+// type plus the heap.
+//
+// alloc_tracker.cpp replaces the global operator new & delete to count
+// allocations, bytes and live/peak live bytes, process-wide and per thread.
+// Copies and moves get counted per type by trackCopy<T>() / trackMove<T>()
+// calls in hand-written copy & move ops, or by a CopyMoveTracked<T> member
+// for classes with defaulted ones.
+//
+// A TrackingRegion snapshots the calling thread's counts and reports the
+// difference, e.g.
+//   { TrackingRegion region("parse request"); parse(request); }
+// prints "parse request: 3 allocs (112 bytes), 3 frees, peak +112 bytes,
+// copies: Header=2, moves: Header=1" when it goes out of scope.
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <string>
+#include <ostream>
+#include <typeinfo>
+
+// operator new/delete of the calling thread (or all threads), only ever growing
+struct AllocCounts {
+  uint64_t allocN;
+  uint64_t freeN;
+  uint64_t allocBytes;
+  uint64_t freeBytes;
+  int64_t liveBytes; // allocBytes - freeBytes, per thread negative if it frees others' memory
+  int64_t peakLiveBytes;
+};
+
+AllocCounts threadAllocCounts();
+AllocCounts processAllocCounts();
+
+// per thread copy & move counts of one type, the thread's types form a list
+struct TypeOpCounts {
+  const std::type_info* type;
+  uint64_t copyN;
+  uint64_t moveN;
+  TypeOpCounts* next;
+};
+
+TypeOpCounts*& threadTypeOpCountsHead();
+
+template <class T>
+TypeOpCounts& typeOpCounts() {
+  // no allocation in here, this gets called from copy ctors
+  static thread_local TypeOpCounts counts = { nullptr, 0, 0, nullptr };
+  if (counts.type == nullptr) {
+    counts.type = &typeid(T);
+    counts.next = threadTypeOpCountsHead();
+    threadTypeOpCountsHead() = &counts;
+  }
+  return counts;
+}
+
+template <class T> void trackCopy() { ++typeOpCounts<T>().copyN; }
+template <class T> void trackMove() { ++typeOpCounts<T>().moveN; }
+
+// Member that counts the copies & moves of its Owner, for classes whose
+// copy & move ops are compiler generated:
+//   class Request { ... CopyMoveTracked<Request> tracked; };
+template <class Owner>
+class CopyMoveTracked {
+  public:
+    CopyMoveTracked() {}
+    CopyMoveTracked(const CopyMoveTracked&) { trackCopy<Owner>(); }
+    CopyMoveTracked(CopyMoveTracked&&) { trackMove<Owner>(); }
+    CopyMoveTracked& operator=(const CopyMoveTracked&) { trackCopy<Owner>(); return *this; }
+    CopyMoveTracked& operator=(CopyMoveTracked&&) { trackMove<Owner>(); return *this; }
+};
+
+// demangled if the compiler lets us
+std::string typeName(const std::type_info& type);
+
+// what happened on the calling thread since a TrackingRegion started
+struct TrackingStats {
+  struct TypeOps {
+    const std::type_info* type;
+    uint64_t copyN;
+    uint64_t moveN;
+  };
+
+  uint64_t allocN;
+  uint64_t freeN;
+  uint64_t allocBytes;
+  uint64_t freeBytes;
+  int64_t peakLiveBytes; // above what was live at the start
+  std::vector<TypeOps> typeOps; // types with copies or moves only
+
+  template <class T> uint64_t copies() const { return find(typeid(T)).copyN; }
+  template <class T> uint64_t moves() const { return find(typeid(T)).moveN; }
+
+  void print(std::ostream& out) const;
+
+  private:
+    TypeOps find(const std::type_info& type) const;
+};
+
+class TrackingRegion {
+  public:
+    // reports to cout at the end of the scope unless reportAtEnd is false
+    explicit TrackingRegion(const char* name, bool reportAtEnd = true);
+    ~TrackingRegion();
+
+    const char* name() const { return name_; }
+    TrackingStats stats() const;
+    void reset();
+
+  private:
+    TrackingRegion(const TrackingRegion&); // = delete, but vs2012
+    TrackingRegion& operator=(const TrackingRegion&);
+
+    const char* const name_;
+    const bool reportAtEnd_;
+    AllocCounts start_;
+    int64_t outerPeakLiveBytes_; // the thread's peak before we started tracking ours
+    std::vector<TypeOpCounts> typeOpsStart_;
+};
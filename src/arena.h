@@ -0,0 +1,184 @@
+// Arena (monotonic bump) allocation for short-lived object graphs, like
+// everything a request builds up and drops at the end.
+//
+// Allocating is bumping a pointer within the current chunk, deallocating
+// does nothing, and reset() drops everything at once. reset() keeps the
+// memory for the next round: a single chunk stays as is, several get
+// replaced by one as big as all of them, so once an arena has seen its
+// biggest request a reset() is O(1) and rounds make no upstream allocation
+// at all. Objects in the arena still need their destructors run if those
+// do more than free memory.
+//
+// ArenaResource is a std::pmr::memory_resource when compiled as C++17 (see
+// ARENA_HAS_PMR), ArenaAllocator<T> plugs it into std containers in any
+// case, e.g. basic_string<char, char_traits<char>, ArenaAllocator<char>>.
+// Not thread-safe, an arena belongs to one request.
+// See stl_benchmark_arena() in stl.cpp.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <algorithm>
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define ARENA_HAS_PMR 1
+#endif
+#endif
+
+class ArenaResource
+#ifdef ARENA_HAS_PMR
+    : public std::pmr::memory_resource
+#endif
+{
+  public:
+    // the first chunk gets allocated on first use, later ones double
+    explicit ArenaResource(size_t firstChunkBytes = 4096)
+        : chunks_(nullptr), next_(nullptr), end_(nullptr), nextChunkBytes_(firstChunkBytes),
+          allocatedBytes_(0), upstreamN_(0) {}
+
+    ~ArenaResource() {
+      release();
+    }
+
+#ifndef ARENA_HAS_PMR
+    // what std::pmr::memory_resource would offer
+    void* allocate(size_t bytes, size_t alignment = alignof(std::max_align_t)) {
+      return do_allocate(bytes, alignment);
+    }
+    void deallocate(void* p, size_t bytes, size_t alignment = alignof(std::max_align_t)) {
+      do_deallocate(p, bytes, alignment);
+    }
+#endif
+
+    // frees all that was allocated, keeping the memory, see above
+    void reset() {
+      if (chunks_ != nullptr && chunks_->next != nullptr) {
+        size_t totalBytes = 0;
+        for (Chunk* chunk = chunks_; chunk != nullptr; chunk = chunk->next)
+          totalBytes += chunk->bytes;
+        release();
+        addChunk(totalBytes);
+      }
+      if (chunks_ != nullptr) {
+        next_ = chunks_->data();
+        end_ = next_ + chunks_->bytes;
+      }
+      allocatedBytes_ = 0;
+    }
+
+    // frees all that was allocated and gives the memory back
+    void release() {
+      while (chunks_ != nullptr) {
+        Chunk* chunk = chunks_;
+        chunks_ = chunk->next;
+        ::operator delete(chunk);
+      }
+      next_ = end_ = nullptr;
+      allocatedBytes_ = 0;
+    }
+
+    size_t allocatedBytes() const { return allocatedBytes_; } // since the last reset()
+    size_t upstreamAllocationN() const { return upstreamN_; } // chunks ever allocated
+
+  protected:
+    void* do_allocate(size_t bytes, size_t alignment)
+#ifdef ARENA_HAS_PMR
+        override
+#endif
+    {
+      char* p = align(next_, alignment);
+      // aligning may overshoot end_ when the chunk is nearly full
+      if (p == nullptr || p > end_ || bytes > static_cast<size_t>(end_ - p)) {
+        addChunk(std::max(bytes + alignment, nextChunkBytes_));
+        p = align(next_, alignment);
+      }
+      next_ = p + bytes;
+      allocatedBytes_ += bytes;
+      return p;
+    }
+
+    void do_deallocate(void*, size_t, size_t)
+#ifdef ARENA_HAS_PMR
+        override
+#endif
+    {}
+
+#ifdef ARENA_HAS_PMR
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+      return this == &other;
+    }
+#endif
+
+  private:
+    ArenaResource(const ArenaResource&); // = delete, but vs2012
+    ArenaResource& operator=(const ArenaResource&);
+
+    // header in front of each chunk's bytes
+    struct alignas(std::max_align_t) Chunk {
+      Chunk* next;
+      size_t bytes;
+      char* data() { return reinterpret_cast<char*>(this + 1); }
+    };
+
+    static char* align(char* p, size_t alignment) {
+      if (p == nullptr)
+        return nullptr;
+      const uintptr_t address = reinterpret_cast<uintptr_t>(p);
+      return p + ((alignment - address % alignment) % alignment);
+    }
+
+    // becomes the current chunk, the rest of the previous one is wasted
+    void addChunk(size_t bytes) {
+      Chunk* chunk = static_cast<Chunk*>(::operator new(sizeof(Chunk) + bytes));
+      chunk->next = chunks_;
+      chunk->bytes = bytes;
+      chunks_ = chunk;
+      next_ = chunk->data();
+      end_ = next_ + bytes;
+      nextChunkBytes_ = 2 * bytes;
+      ++upstreamN_;
+    }
+
+    Chunk* chunks_; // newest first
+    char* next_;
+    char* end_;
+    size_t nextChunkBytes_;
+    size_t allocatedBytes_;
+    size_t upstreamN_;
+};
+
+// C++11 allocator on top of an ArenaResource, for when std::pmr isn't around
+template <class T>
+class ArenaAllocator {
+  public:
+    typedef T value_type;
+
+    explicit ArenaAllocator(ArenaResource& arena) : arena_(&arena) {}
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>& rhs) : arena_(rhs.arena()) {}
+
+    T* allocate(size_t n) {
+      return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T* p, size_t n) {
+      arena_->deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    ArenaResource* arena() const { return arena_; }
+
+  private:
+    ArenaResource* arena_;
+};
+
+template <class T, class U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+  return a.arena() == b.arena();
+}
+template <class T, class U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+  return a.arena() != b.arena();
+}
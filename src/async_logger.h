@@ -0,0 +1,299 @@
+// Asynchronous logger: logging threads don't format, lock or write anything.
+//
+// Each logging thread gets its own SpscQueue of fixed-size binary records
+// (a format string pointer, a timestamp and up to 4 integer args), so
+// log() is a clock read plus a few stores. A background thread drains all
+// queues, sorts the batch by timestamp, formats it and writes it out with
+// one write & flush per batch instead of one per line. It sleeps while
+// there's nothing to write, a log() only wakes it (taking its mutex) if it
+// is asleep, i.e. for the first record after a quiet spell. The writer then
+// waits up to 1ms for more to come before draining.
+//
+// Memory is bounded by capacityPerThread records per live logging thread.
+// When a thread's queue is full log() either drops the record (counted and
+// reported in the output) or blocks until the writer makes room, see
+// LogOverflow. Format strings must outlive the logger, i.e. be literals,
+// and "{}" marks where the next arg goes.
+// See benchmarkLogging() in threading.cpp.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <memory>
+#include <string>
+#include <algorithm>
+#include <utility>
+#include <type_traits>
+#include <ostream>
+
+#include "spsc_queue.h"
+#include "cache_aligned.h"
+
+enum class LogOverflow { Drop, Block };
+
+class AsyncLogger {
+  public:
+    AsyncLogger(std::ostream& out, LogOverflow overflow, size_t capacityPerThread = 1024)
+        : out_(out), overflow_(overflow), capacityPerThread_(capacityPerThread), id_(nextId()),
+          start_(Clock::now()), threadN_(0), full_(false), writerAsleep_(false), flushRequested_(0), flushDone_(0), stop_(false),
+          writer_([this]() { writerLoop(); }) {}
+
+    // writes out everything logged so far, logging concurrently with the
+    // destructor isn't allowed
+    ~AsyncLogger() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      wakeWriter_.notify_one();
+      writer_.join();
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto& buffer : buffers_)
+        buffer->loggerGone.store(true, std::memory_order_relaxed);
+    }
+
+    // e.g. log("consumed item={}", item), args need to be integral
+    template <class... Args>
+    void log(const char* format, Args... args) {
+      static_assert(sizeof...(Args) <= Record::maxArgN, "AsyncLogger: too many args");
+      Record record;
+      record.format = format;
+      record.ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start_).count();
+      record.argN = 0;
+      storeArgs(record, args...);
+      ThreadBuffer& buffer = threadBuffer();
+      if (buffer.queue.tryPush(record)) {
+        wakeWriterIfAsleep();
+        return;
+      }
+      if (overflow_ == LogOverflow::Drop) {
+        buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        full_.store(true, std::memory_order_relaxed);
+      }
+      wakeWriter_.notify_one();
+      while (!buffer.queue.tryPush(record))
+        std::this_thread::yield();
+    }
+
+    // returns once everything logged before the call is written
+    void flush() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      const uint64_t generation = ++flushRequested_;
+      wakeWriter_.notify_one();
+      flushed_.wait(lock, [this, generation]() { return flushDone_ >= generation; });
+    }
+
+  private:
+    AsyncLogger(const AsyncLogger&); // = delete, but vs2012
+    AsyncLogger& operator=(const AsyncLogger&);
+
+    typedef std::chrono::steady_clock Clock;
+
+    struct Record {
+      static const int maxArgN = 4;
+      const char* format;
+      int64_t ns; // since the logger started
+      int32_t threadIndex; // filled in by the writer
+      int32_t argN;
+      int64_t args[maxArgN];
+    };
+
+    // heap allocated, so CacheAligned for the queue's alignas(64) indices
+    struct ThreadBuffer : CacheAligned {
+      ThreadBuffer(size_t capacity, int index)
+          : queue(capacity), index(index), dropped(0), threadGone(false), loggerGone(false) {}
+      SpscQueue<Record> queue; // logging thread -> writer
+      const int index; // shows up as t<index> in the output
+      std::atomic<uint64_t> dropped;
+      std::atomic<bool> threadGone; // the writer may forget it once empty
+      std::atomic<bool> loggerGone; // the thread may forget it
+    };
+
+    // a thread's buffers, one per logger it logged to
+    struct ThreadBuffers {
+      ~ThreadBuffers() {
+        for (auto& entry : entries)
+          entry.second->threadGone.store(true, std::memory_order_release);
+      }
+      std::vector<std::pair<uint64_t, std::shared_ptr<ThreadBuffer>>> entries;
+    };
+
+    static uint64_t nextId() {
+      static std::atomic<uint64_t> id(0);
+      return ++id;
+    }
+
+    static void storeArgs(Record&) {}
+    template <class Arg, class... Args>
+    static void storeArgs(Record& record, Arg arg, Args... args) {
+      static_assert(std::is_integral<Arg>::value, "AsyncLogger: args need to be integral");
+      record.args[record.argN++] = static_cast<int64_t>(arg);
+      storeArgs(record, args...);
+    }
+
+    ThreadBuffer& threadBuffer() {
+      static thread_local ThreadBuffers buffers;
+      for (auto& entry : buffers.entries)
+        if (entry.first == id_)
+          return *entry.second;
+      // first log() of this thread to this logger, also forget dead loggers' buffers
+      buffers.entries.erase(std::remove_if(buffers.entries.begin(), buffers.entries.end(),
+          [](const std::pair<uint64_t, std::shared_ptr<ThreadBuffer>>& entry) {
+            return entry.second->loggerGone.load(std::memory_order_relaxed);
+          }), buffers.entries.end());
+      std::shared_ptr<ThreadBuffer> buffer(new ThreadBuffer(capacityPerThread_, threadN_++));
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        buffers_.push_back(buffer);
+      }
+      buffers.entries.push_back(std::make_pair(id_, buffer));
+      return *buffer;
+    }
+
+    // The fence here and the one in writerLoop() make sure that either the
+    // writer sees our record before going to sleep or we see it asleep.
+    void wakeWriterIfAsleep() {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!writerAsleep_.load(std::memory_order_relaxed))
+        return;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        writerAsleep_.store(false, std::memory_order_relaxed);
+      }
+      wakeWriter_.notify_one();
+    }
+
+    void writerLoop() {
+      std::vector<Record> batch;
+      std::string text;
+      for (;;) {
+        uint64_t generation;
+        bool stop;
+        std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          writerAsleep_.store(true, std::memory_order_relaxed);
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+          bool pending = false;
+          for (auto& buffer : buffers_)
+            pending = pending || !buffer->queue.empty();
+          if (pending)
+            writerAsleep_.store(false, std::memory_order_relaxed);
+          auto urgent = [this]() {
+            return stop_ || flushRequested_ != flushDone_ || full_.load(std::memory_order_relaxed);
+          };
+          wakeWriter_.wait(lock, [this, &urgent]() {
+            return urgent() || !writerAsleep_.load(std::memory_order_relaxed);
+          });
+          // Woken for a record: give the others a moment to pile up, else
+          // steady logging would wake us (and cost a syscall) per record.
+          if (!urgent())
+            wakeWriter_.wait_for(lock, std::chrono::milliseconds(1), urgent);
+          writerAsleep_.store(false, std::memory_order_relaxed);
+          generation = flushRequested_;
+          stop = stop_;
+          buffers = buffers_;
+        }
+        full_.store(false, std::memory_order_relaxed);
+
+        batch.clear();
+        text.clear();
+        for (auto& buffer : buffers) {
+          const bool threadGone = buffer->threadGone.load(std::memory_order_acquire);
+          Record record;
+          while (buffer->queue.tryPop(record)) {
+            record.threadIndex = buffer->index;
+            batch.push_back(record);
+          }
+          if (uint64_t dropped = buffer->dropped.exchange(0, std::memory_order_relaxed))
+            text += "t" + std::to_string(buffer->index) + " dropped " + std::to_string(dropped) + " records\n";
+          if (threadGone) { // and drained above
+            std::lock_guard<std::mutex> lock(mutex_);
+            buffers_.erase(std::find(buffers_.begin(), buffers_.end(), buffer));
+          }
+        }
+        std::stable_sort(batch.begin(), batch.end(),
+            [](const Record& a, const Record& b) { return a.ns < b.ns; });
+        for (const Record& record : batch)
+          format(record, text);
+        if (!text.empty()) {
+          out_.write(text.data(), text.size());
+          out_.flush();
+        }
+
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          flushDone_ = generation;
+        }
+        flushed_.notify_all();
+        if (stop)
+          return;
+      }
+    }
+
+    // "[  1234us t2] consumed item=7"
+    static void format(const Record& record, std::string& text) {
+      text += '[';
+      appendInt(text, record.ns / 1000, 8);
+      text += "us t";
+      appendInt(text, record.threadIndex, 0);
+      text += "] ";
+      int arg = 0;
+      for (const char* p = record.format; *p; ++p) {
+        if (p[0] == '{' && p[1] == '}' && arg < record.argN) {
+          appendInt(text, record.args[arg++], 0);
+          ++p;
+        }
+        else {
+          text += *p;
+        }
+      }
+      text += '\n';
+    }
+
+    // right-aligned in width chars, without to_string's temporary
+    static void appendInt(std::string& text, int64_t value, size_t width) {
+      char digits[24];
+      char* p = digits + sizeof(digits);
+      uint64_t magnitude = value < 0 ? 0 - static_cast<uint64_t>(value) : value;
+      do {
+        *--p = static_cast<char>('0' + magnitude % 10);
+        magnitude /= 10;
+      } while (magnitude != 0);
+      if (value < 0)
+        *--p = '-';
+      const size_t n = digits + sizeof(digits) - p;
+      if (n < width)
+        text.append(width - n, ' ');
+      text.append(p, n);
+    }
+
+    std::ostream& out_; // writer only
+    const LogOverflow overflow_;
+    const size_t capacityPerThread_;
+    const uint64_t id_;
+    const Clock::time_point start_;
+    std::atomic<int> threadN_;
+    std::atomic<bool> full_; // some log() blocks
+    std::atomic<bool> writerAsleep_; // set by the writer, cleared by whoever wakes it
+
+    std::mutex mutex_; // guards what follows
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers_;
+    uint64_t flushRequested_;
+    uint64_t flushDone_;
+    bool stop_;
+    std::condition_variable wakeWriter_;
+    std::condition_variable flushed_;
+
+    std::thread writer_; // last, so that everything it uses exists once it starts
+};
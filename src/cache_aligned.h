@@ -0,0 +1,46 @@
+// Base for heap allocated types with alignas(64) members (or members that
+// have some, like ChaseLevDeque or SpscQueue).
+//
+// Before C++17 plain new only guarantees malloc's alignment (16 bytes) and
+// ignores alignas beyond that, gcc's -Waligned-new says as much. Then the
+// padding meant to keep hot atomics on their own cache lines isn't worth
+// much, since the lines may start anywhere. Deriving from CacheAligned
+// gives the type a class operator new that does honor 64 bytes:
+//   struct Worker : CacheAligned { ChaseLevDeque<Task> deque; ... };
+// Types on the stack or static ones don't need this, there alignas works.
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+#ifdef _MSC_VER
+#include <malloc.h> // _aligned_malloc
+#else
+#include <stdlib.h> // posix_memalign
+#endif
+
+// the one line size all padding & alignas in src/ and MemBandwidthTest assume
+const size_t cacheLineSize = 64;
+
+struct CacheAligned {
+  static void* operator new(size_t size) {
+#ifdef _MSC_VER
+    void* p = _aligned_malloc(size, cacheLineSize);
+#else
+    void* p = nullptr;
+    if (posix_memalign(&p, cacheLineSize, size) != 0)
+      p = nullptr;
+#endif
+    if (p == nullptr)
+      throw std::bad_alloc();
+    return p;
+  }
+
+  static void operator delete(void* p) {
+#ifdef _MSC_VER
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+  }
+};
@@ -0,0 +1,441 @@
+// C++20 coroutine playground: a lazy Task<T>, a Scheduler multiplexing
+// coroutines onto a few threads, and an awaitable Channel<T>.
+//
+// The point vs threading.cpp's ProducerConsumer: a consumer waiting on an
+// empty channel suspends its coroutine (a heap frame of a few hundred
+// bytes) instead of parking a kernel thread with its own stack in
+// conditionVariable.wait(). So thousands of producers & consumers are fine.
+// Finally what the generator wishes in stl.cpp and Readme.md were after,
+// though it took until C++20.
+//
+// Needs -std=c++20 (see play.gyp), with older standards this compiles to a stub.
+
+#include <iostream>
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+
+#include <coroutine>
+#include <optional>
+#include <exception>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <latch>
+#include <chrono>
+#include <iomanip>
+#include <fstream>
+#include <stdexcept>
+#include <utility> // std::exchange
+#include <unistd.h> // sysconf
+
+#include "mpmc_queue.h"
+
+using namespace std;
+
+namespace {
+
+// live bytes of coroutine frames, see the promise types' operator new
+atomic<size_t> frameBytes(0);
+
+// gcc's -Wmismatched-new-delete pairs the frame's new & delete by name, and
+// sees ::operator new vs CountedFrame's delete once new got inlined into the
+// coroutine
+#ifdef __GNUC__
+#define FRAME_ALLOC_NOINLINE __attribute__((noinline))
+#else
+#define FRAME_ALLOC_NOINLINE
+#endif
+
+// Frames get allocated via the promise's operator new if it has one, which
+// is how we count them. The size is passed back to delete.
+struct CountedFrame {
+  FRAME_ALLOC_NOINLINE static void* operator new(size_t size) {
+    frameBytes += size;
+    return ::operator new(size);
+  }
+  // sized for the count only, freeing pairs with the unsized new above
+  FRAME_ALLOC_NOINLINE static void operator delete(void* p, size_t size) {
+    frameBytes -= size;
+    ::operator delete(p);
+  }
+};
+
+// Run queue plus worker threads that resume whatever coroutine is next.
+class Scheduler {
+  public:
+    explicit Scheduler(int threadN) : stop(false) {
+      for (int i=0; i<threadN; ++i)
+        threads.push_back(thread([this]() { run(); }));
+    }
+
+    ~Scheduler() {
+      {
+        lock_guard<std::mutex> lock(mutex);
+        stop = true;
+      }
+      condition.notify_all();
+      for (auto& t : threads)
+        t.join();
+    }
+
+    void schedule(coroutine_handle<> handle) {
+      {
+        lock_guard<std::mutex> lock(mutex);
+        ready.push_back(handle);
+      }
+      condition.notify_one();
+    }
+
+    // co_await scheduler.yield() continues on one of the scheduler's threads
+    auto yield() {
+      struct Awaiter {
+        Scheduler& scheduler;
+        bool await_ready() { return false; }
+        void await_suspend(coroutine_handle<> handle) { scheduler.schedule(handle); }
+        void await_resume() {}
+      };
+      return Awaiter{*this};
+    }
+
+  private:
+    void run() {
+      for (;;) {
+        coroutine_handle<> handle;
+        {
+          unique_lock<std::mutex> lock(mutex);
+          condition.wait(lock, [this]() { return stop || !ready.empty(); });
+          if (ready.empty())
+            return;
+          handle = ready.front();
+          ready.pop_front();
+        }
+        handle.resume();
+      }
+    }
+
+    std::mutex mutex;
+    condition_variable condition;
+    deque<coroutine_handle<>> ready;
+    bool stop;
+    vector<thread> threads;
+};
+
+template <class T = void>
+class Task;
+
+// Hands control straight back to whoever awaited the finished task
+// (symmetric transfer, so long chains of tasks don't pile up stack frames).
+struct FinalAwaiter {
+  bool await_ready() noexcept { return false; }
+  template <class Promise>
+  coroutine_handle<> await_suspend(coroutine_handle<Promise> handle) noexcept {
+    coroutine_handle<> continuation = handle.promise().continuation;
+    return continuation ? continuation : noop_coroutine();
+  }
+  void await_resume() noexcept {}
+};
+
+struct TaskPromiseBase : CountedFrame {
+  coroutine_handle<> continuation; // whoever co_awaits the task
+  exception_ptr error;
+
+  // lazy: nothing runs until someone co_awaits the task
+  suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter final_suspend() noexcept { return {}; }
+
+  void unhandled_exception() { error = current_exception(); }
+};
+
+template <class T>
+struct TaskPromise : TaskPromiseBase {
+  optional<T> value;
+
+  Task<T> get_return_object();
+  void return_value(T v) { value = std::move(v); }
+  T result() {
+    if (error)
+      rethrow_exception(error);
+    return std::move(*value);
+  }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+  Task<void> get_return_object();
+  void return_void() {}
+  void result() {
+    if (error)
+      rethrow_exception(error);
+  }
+};
+
+// co_await task gives its co_return value (or throws what it threw)
+template <class T>
+class Task {
+  public:
+    typedef TaskPromise<T> promise_type;
+
+    Task(Task&& rhs) noexcept : handle(exchange(rhs.handle, nullptr)) {}
+    ~Task() {
+      if (handle)
+        handle.destroy();
+    }
+
+    bool await_ready() { return false; }
+    coroutine_handle<> await_suspend(coroutine_handle<> awaiter) {
+      handle.promise().continuation = awaiter;
+      return handle;
+    }
+    T await_resume() { return handle.promise().result(); }
+
+  private:
+    friend struct TaskPromise<T>;
+    explicit Task(coroutine_handle<promise_type> handle) : handle(handle) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    coroutine_handle<promise_type> handle;
+};
+
+template <class T>
+Task<T> TaskPromise<T>::get_return_object() {
+  return Task<T>(coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+inline Task<void> TaskPromise<void>::get_return_object() {
+  return Task<void>(coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// fire & forget coroutine, its frame goes away when it's done
+struct Detached {
+  struct promise_type : CountedFrame {
+    Detached get_return_object() { return {}; }
+    suspend_never initial_suspend() noexcept { return {}; }
+    suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { terminate(); }
+  };
+};
+
+// runs task on the scheduler's threads, counting down done when finished
+Detached spawn(Scheduler& scheduler, Task<void> task, latch& done) {
+  co_await scheduler.yield();
+  co_await task;
+  done.count_down();
+}
+
+// Unbounded multi-producer/multi-consumer channel. send() never suspends,
+// co_await receive() does while the channel is empty, and yields nullopt
+// once it got closed and drained.
+template <class T>
+class Channel {
+  public:
+    explicit Channel(Scheduler& scheduler) : scheduler(scheduler), closed(false) {}
+
+    void send(T item) {
+      unique_lock<std::mutex> lock(mutex);
+      if (receivers.empty()) {
+        items.push_back(std::move(item));
+        return;
+      }
+      // hand the item straight to a suspended receiver
+      Receiver* receiver = receivers.front();
+      receivers.pop_front();
+      receiver->item = std::move(item);
+      lock.unlock();
+      scheduler.schedule(receiver->handle);
+    }
+
+    void close() {
+      deque<Receiver*> waiting;
+      {
+        lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        waiting.swap(receivers);
+      }
+      for (Receiver* receiver : waiting)
+        scheduler.schedule(receiver->handle);
+    }
+
+    auto receive() { return Receiver{*this, nullopt, nullptr}; }
+
+  private:
+    struct Receiver {
+      Channel& channel;
+      optional<T> item;
+      coroutine_handle<> handle;
+
+      bool await_ready() { return false; }
+      // returns false (i.e. no suspension) if there's an item already or the channel is closed
+      bool await_suspend(coroutine_handle<> h) {
+        lock_guard<std::mutex> lock(channel.mutex);
+        if (!channel.items.empty()) {
+          item = std::move(channel.items.front());
+          channel.items.pop_front();
+          return false;
+        }
+        if (channel.closed)
+          return false;
+        handle = h;
+        channel.receivers.push_back(this);
+        return true;
+      }
+      optional<T> await_resume() { return std::move(item); }
+    };
+
+    Scheduler& scheduler;
+    std::mutex mutex;
+    deque<T> items;
+    deque<Receiver*> receivers;
+    bool closed;
+};
+
+Task<long long> sumUntilClosed(Channel<int>& channel) {
+  long long sum = 0;
+  while (optional<int> item = co_await channel.receive())
+    sum += *item;
+  co_return sum;
+}
+
+Task<void> producer(Channel<int>& channel, int first, int count, atomic<int>& producersLeft) {
+  for (int i=first; i<first+count; ++i)
+    channel.send(i);
+  if (--producersLeft == 0)
+    channel.close();
+  co_return;
+}
+
+Task<void> consumer(Channel<int>& channel, atomic<long long>& total) {
+  total += co_await sumUntilClosed(channel);
+}
+
+// Thousands of producers & consumers on a handful of threads.
+void pipelineDemo() {
+  const int producerN = 1000, consumerN = 1000, itemsPerProducer = 100;
+  const int itemN = producerN * itemsPerProducer;
+  auto t0 = chrono::steady_clock::now();
+  atomic<long long> total(0);
+  atomic<int> producersLeft(producerN);
+  {
+    Scheduler scheduler(4);
+    Channel<int> channel(scheduler);
+    latch done(producerN + consumerN);
+    for (int c=0; c<consumerN; ++c)
+      spawn(scheduler, consumer(channel, total), done);
+    for (int p=0; p<producerN; ++p)
+      spawn(scheduler, producer(channel, p * itemsPerProducer, itemsPerProducer, producersLeft), done);
+    done.wait();
+  }
+  if (total != static_cast<long long>(itemN) * (itemN - 1) / 2)
+    throw runtime_error("pipelineDemo: items got lost or duplicated");
+  cout << "\n" << producerN << " producers -> " << consumerN << " consumers, " << itemN << " items on 4 threads: "
+       << chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count() << " ms\n";
+}
+
+Task<void> pinger(Channel<int>& ping, Channel<int>& pong, int roundTripN) {
+  for (int i=0; i<roundTripN; ++i) {
+    ping.send(i);
+    if (co_await pong.receive() != i)
+      throw runtime_error("pinger: items got mixed up");
+  }
+  ping.close();
+}
+
+Task<void> ponger(Channel<int>& ping, Channel<int>& pong) {
+  while (optional<int> item = co_await ping.receive())
+    pong.send(*item);
+}
+
+// resident & virtual bytes of this process, 0 off Linux
+pair<size_t, size_t> memoryUsage() {
+  size_t virtualPages = 0, residentPages = 0;
+  ifstream statm("/proc/self/statm");
+  statm >> virtualPages >> residentPages;
+  const size_t pageSize = sysconf(_SC_PAGESIZE);
+  return make_pair(residentPages * pageSize, virtualPages * pageSize);
+}
+
+// Hand-off cost & memory per waiting consumer: coroutines suspended on a
+// Channel vs threads parked on a BlockingMpmcQueue.
+void benchmarkCoroutinesVsThreads() {
+  const int roundTripN = 100000;
+  cout << "\nhand-off between 2 consumers, ns\n";
+  {
+    Scheduler scheduler(1);
+    Channel<int> ping(scheduler), pong(scheduler);
+    latch done(2);
+    auto t0 = chrono::steady_clock::now();
+    spawn(scheduler, ponger(ping, pong), done);
+    spawn(scheduler, pinger(ping, pong, roundTripN), done);
+    done.wait();
+    cout << setw(24) << "coroutines, 1 thread" << setw(10) << fixed << setprecision(0)
+         << chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count() / (2 * roundTripN) << '\n';
+  }
+  {
+    BlockingMpmcQueue<int> ping(2), pong(2);
+    auto t0 = chrono::steady_clock::now();
+    thread echo([&]() {
+      for (int i=0; i<roundTripN; ++i)
+        pong.push(ping.pop());
+    });
+    for (int i=0; i<roundTripN; ++i) {
+      ping.push(i);
+      pong.pop();
+    }
+    echo.join();
+    cout << setw(24) << "threads" << setw(10)
+         << chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count() / (2 * roundTripN) << '\n';
+  }
+  cout.unsetf(ios::floatfield);
+
+  const int consumerN = 1000;
+  cout << "\nmemory per consumer waiting for an item, " << consumerN << " consumers\n";
+  {
+    Scheduler scheduler(2);
+    Channel<int> channel(scheduler);
+    atomic<long long> total(0);
+    latch done(consumerN);
+    size_t frameBytesBefore = frameBytes;
+    auto before = memoryUsage();
+    for (int c=0; c<consumerN; ++c)
+      spawn(scheduler, consumer(channel, total), done);
+    this_thread::sleep_for(chrono::milliseconds(100)); // let them all get to co_await receive()
+    auto after = memoryUsage();
+    cout << setw(24) << "coroutines" << " frames " << (frameBytes - frameBytesBefore) / consumerN << " bytes, rss "
+         << static_cast<long long>(after.first - before.first) / consumerN << " bytes\n";
+    channel.close();
+    done.wait();
+  }
+  {
+    BlockingMpmcQueue<int> queue(consumerN);
+    vector<thread> consumers;
+    auto before = memoryUsage();
+    for (int c=0; c<consumerN; ++c)
+      consumers.push_back(thread([&queue]() { queue.pop(); }));
+    this_thread::sleep_for(chrono::milliseconds(100));
+    auto after = memoryUsage();
+    cout << setw(24) << "threads" << " rss " << static_cast<long long>(after.first - before.first) / consumerN
+         << " bytes, virtual " << static_cast<long long>(after.second - before.second) / consumerN << " bytes (stack)\n";
+    for (int c=0; c<consumerN; ++c)
+      queue.push(c);
+    for (auto& t : consumers)
+      t.join();
+  }
+}
+
+}
+
+void play_with_coroutines() {
+  pipelineDemo();
+  benchmarkCoroutinesVsThreads();
+}
+
+#else
+
+void play_with_coroutines() {
+  std::cout << "play_with_coroutines needs -std=c++20, see play.gyp\n";
+}
+
+#endif
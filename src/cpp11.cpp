@@ -17,6 +17,8 @@
 #include <tuple>
 #include <thread>
 
+#include "pool_allocator.h"
+
 using namespace std;
 
 namespace {
@@ -1996,6 +1998,14 @@ void play_with_member_pointers() {
   // Anyway, std::distance is handy:
   assert(std::distance(apples3.begin(), apples3.end()) == 4);
 
+  // both allocate a node per elem, from the global heap unless given an
+  // allocator like this one (see stl_benchmark_pool() in stl.cpp):
+  std::list<Apple, PoolAllocator<Apple>> apples4 { apple1, apple2 };
+  apples4.emplace_front(5);
+  assert(apples4.size() == 3);
+  std::forward_list<Apple, PoolAllocator<Apple>> apples5(apples3.begin(), apples3.end());
+  assert(std::distance(apples5.begin(), apples5.end()) == 4);
+
   cout << "we have 0 oranges!\n";
 
 }
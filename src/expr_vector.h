@@ -0,0 +1,119 @@
+// Vector whose +, - and * build an expression tree rather than temporaries.
+//
+// a + b * c is a VecBinary<ExprVector, VecBinary<ExprVector, ExprVector,
+// VecMul>, VecAdd> holding references to a, b & c. Nothing gets computed
+// until it's assigned to an ExprVector, which then evaluates all of it in a
+// single loop over plain element accesses that the compiler can inline and
+// vectorize: no allocation per operator and one pass over memory instead of
+// one per operator.
+//
+// Like A::add_argsByValue_retByValue in move.cpp the longer operand gets
+// cut back to the size of the shorter one. Expressions refer to their
+// operands, so don't keep one around in an auto variable beyond the
+// statement, the operands may be temporaries.
+// See benchmarkExpressionTemplates() in move.cpp.
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#include <initializer_list>
+
+// CRTP base of vectors & expressions, so that the operators below only
+// match those
+template <class E>
+class VecExpr {
+  public:
+    const E& self() const { return static_cast<const E&>(*this); }
+};
+
+template <class T>
+class ExprVector : public VecExpr<ExprVector<T>> {
+  public:
+    typedef T value_type;
+
+    ExprVector() {}
+    explicit ExprVector(size_t n, T value = T()) : data_(n, value) {}
+    ExprVector(std::initializer_list<T> values) : data_(values) {}
+
+    template <class E>
+    ExprVector(const VecExpr<E>& expr) {
+      assign(expr.self());
+    }
+    template <class E>
+    ExprVector& operator=(const VecExpr<E>& expr) {
+      assign(expr.self());
+      return *this;
+    }
+
+    size_t size() const { return data_.size(); }
+    T operator[](size_t i) const { return data_[i]; }
+    T& operator[](size_t i) { return data_[i]; }
+    const T* data() const { return data_.data(); }
+
+  private:
+    // This vector may be one of the operands too, which is fine since
+    // element i only depends on the operands' element i. Resizing only ever
+    // shrinks it then, so doesn't reallocate.
+    template <class E>
+    void assign(const E& expr) {
+      const size_t n = expr.size();
+      data_.resize(n);
+      T* out = data_.data();
+      for (size_t i=0; i<n; ++i)
+        out[i] = expr[i];
+    }
+
+    std::vector<T> data_;
+};
+
+// how expressions hold their operands: vectors by reference, expressions
+// (which are temporaries & small) by value
+template <class E>
+struct VecOperand {
+  typedef const E type;
+};
+template <class T>
+struct VecOperand<ExprVector<T>> {
+  typedef const ExprVector<T>& type;
+};
+
+template <class L, class R, class Op>
+class VecBinary : public VecExpr<VecBinary<L, R, Op>> {
+  public:
+    typedef typename L::value_type value_type;
+
+    VecBinary(const L& l, const R& r) : l_(l), r_(r) {}
+
+    size_t size() const { return std::min(l_.size(), r_.size()); }
+    value_type operator[](size_t i) const { return Op::apply(l_[i], r_[i]); }
+
+  private:
+    typename VecOperand<L>::type l_;
+    typename VecOperand<R>::type r_;
+};
+
+struct VecAdd {
+  template <class T> static T apply(T a, T b) { return a + b; }
+};
+struct VecSub {
+  template <class T> static T apply(T a, T b) { return a - b; }
+};
+struct VecMul {
+  template <class T> static T apply(T a, T b) { return a * b; }
+};
+
+// element-wise
+template <class L, class R>
+VecBinary<L, R, VecAdd> operator+(const VecExpr<L>& l, const VecExpr<R>& r) {
+  return VecBinary<L, R, VecAdd>(l.self(), r.self());
+}
+template <class L, class R>
+VecBinary<L, R, VecSub> operator-(const VecExpr<L>& l, const VecExpr<R>& r) {
+  return VecBinary<L, R, VecSub>(l.self(), r.self());
+}
+template <class L, class R>
+VecBinary<L, R, VecMul> operator*(const VecExpr<L>& l, const VecExpr<R>& r) {
+  return VecBinary<L, R, VecMul>(l.self(), r.self());
+}
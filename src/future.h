@@ -0,0 +1,305 @@
+// Future/promise with continuations, i.e. what std::future lacks (see the
+// Concurrency section in Readme.md): then(), when_all() and when_any().
+//
+// Instead of parking a thread in get() per stage, a continuation gets stored
+// in the shared state and runs when the value arrives, either inline on
+// whatever thread completes the promise or posted to a ThreadPool. Inline
+// continuations are trampolined through a per-thread queue, so a long chain
+// completing at once doesn't recurse once per stage and blow the stack.
+//
+// Like std::future a Future is move-only and single-use: get() and then()
+// consume it, and if the last copy of its Promise goes away unfulfilled it
+// gets a future_error(broken_promise). That also frees the continuations
+// waiting on it, which hold on to their source's state. T can't be void,
+// use some dummy value instead.
+// See benchmarkContinuations() in threading.cpp.
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <future> // future_error
+#include <functional>
+#include <vector>
+#include <utility>
+#include <atomic>
+#include <stdexcept>
+
+#include "thread_pool.h"
+
+template <class T> class Future;
+template <class T> class Promise;
+
+// what Promise & Future share
+template <class T>
+class FutureState {
+  public:
+    FutureState() : ready_(false) {}
+
+    void complete(std::unique_ptr<T> value, std::exception_ptr error) {
+      if (!tryComplete(std::move(value), error))
+        throw std::future_error(std::future_errc::promise_already_satisfied);
+    }
+
+    // by the last Promise going away, a no-op if it got fulfilled
+    void abandon() {
+      try {
+        tryComplete(nullptr, std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+      }
+      catch (...) {} // from a continuation, and called from a dtor
+    }
+
+    // runs continuation once ready, right away if it already is
+    void setContinuation(std::function<void()> continuation) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!ready_) {
+          continuation_ = std::move(continuation);
+          return;
+        }
+      }
+      runInline(std::move(continuation));
+    }
+
+    bool isReady() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return ready_;
+    }
+
+    void wait() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      readyCondition_.wait(lock, [this]() { return ready_; });
+    }
+
+    // only once ready
+    T takeValue() {
+      if (error_)
+        std::rethrow_exception(error_);
+      return std::move(*value_);
+    }
+    std::exception_ptr error() const { return error_; }
+
+  private:
+    // false if ready already
+    bool tryComplete(std::unique_ptr<T> value, std::exception_ptr error) {
+      std::function<void()> continuation;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (ready_)
+          return false;
+        value_ = std::move(value);
+        error_ = error;
+        ready_ = true;
+        continuation.swap(continuation_);
+      }
+      readyCondition_.notify_all();
+      if (continuation)
+        runInline(std::move(continuation));
+      return true;
+    }
+
+    // Continuations that complete further promises land here again, these
+    // get queued and run by the outermost call instead of nesting. One that
+    // throws doesn't stop the ones queued behind it, their futures would
+    // never get ready otherwise. The first exception gets rethrown at the
+    // end, to whoever completed the promise.
+    static void runInline(std::function<void()> f) {
+      typedef std::vector<std::function<void()>> Queue;
+      static thread_local Queue* pending = nullptr;
+      if (pending != nullptr) {
+        pending->push_back(std::move(f));
+        return;
+      }
+      // however we leave, later calls mustn't queue onto our dead queue
+      struct ResetPending {
+        Queue*& pending;
+        ~ResetPending() { pending = nullptr; }
+      };
+      Queue queue(1, std::move(f));
+      pending = &queue;
+      ResetPending resetPending = { pending };
+      std::exception_ptr error;
+      for (size_t i=0; i<queue.size(); ++i) {
+        std::function<void()> next = std::move(queue[i]); // queue may grow meanwhile
+        try {
+          next();
+        }
+        catch (...) {
+          if (!error)
+            error = std::current_exception();
+        }
+      }
+      if (error)
+        std::rethrow_exception(error);
+    }
+
+    std::mutex mutex_;
+    std::condition_variable readyCondition_;
+    bool ready_;
+    std::unique_ptr<T> value_;
+    std::exception_ptr error_;
+    std::function<void()> continuation_;
+};
+
+template <class T>
+class Future {
+  public:
+    Future() {}
+
+    bool valid() const { return state_ != nullptr; }
+    bool is_ready() const { return state_->isReady(); }
+    void wait() const { state_->wait(); }
+
+    // blocks until ready, rethrows what the promise got as exception
+    T get() {
+      std::shared_ptr<FutureState<T>> state = std::move(state_);
+      state->wait();
+      return state->takeValue();
+    }
+
+    // Future of f(value), with f running on the thread that completes this
+    // future (or right here if it's complete already). If this future
+    // completes with an exception f is skipped and the result gets it too.
+    template <class F>
+    auto then(F f) -> Future<decltype(f(std::declval<T>()))> {
+      return thenVia(nullptr, std::move(f));
+    }
+
+    // same, f runs as a task on pool
+    template <class F>
+    auto then(ThreadPool& pool, F f) -> Future<decltype(f(std::declval<T>()))> {
+      return thenVia(&pool, std::move(f));
+    }
+
+  private:
+    template <class U> friend class Promise;
+    template <class U> friend class Future;
+    template <class U> friend Future<std::vector<U>> when_all(std::vector<Future<U>> futures);
+    template <class U> friend Future<std::pair<size_t, U>> when_any(std::vector<Future<U>> futures);
+
+    explicit Future(std::shared_ptr<FutureState<T>> state) : state_(std::move(state)) {}
+
+    template <class F>
+    auto thenVia(ThreadPool* pool, F f) -> Future<decltype(f(std::declval<T>()))> {
+      typedef decltype(f(std::declval<T>())) R;
+      Promise<R> promise;
+      Future<R> result = promise.get_future();
+      std::shared_ptr<FutureState<T>> state = std::move(state_);
+      FutureState<T>* source = state.get();
+      std::function<void()> run = [state, promise, f]() mutable {
+        try {
+          promise.set_value(f(state->takeValue()));
+        }
+        catch (...) {
+          promise.set_exception(std::current_exception());
+        }
+      };
+      if (pool != nullptr)
+        source->setContinuation([pool, run]() { pool->post(run); });
+      else
+        source->setContinuation(std::move(run));
+      return result;
+    }
+
+    std::shared_ptr<FutureState<T>> state_;
+};
+
+// Copyable so that continuations (which std::function wants copyable) can
+// hold one. Setting it twice throws like std::promise does.
+template <class T>
+class Promise {
+  public:
+    Promise() : owner_(std::make_shared<Owner>()) {}
+
+    Future<T> get_future() { return Future<T>(owner_->state); }
+    void set_value(T value) { owner_->state->complete(std::unique_ptr<T>(new T(std::move(value))), nullptr); }
+    void set_exception(std::exception_ptr error) { owner_->state->complete(nullptr, error); }
+
+  private:
+    // shared by all copies, the last one breaks the promise if unfulfilled
+    struct Owner {
+      Owner() : state(std::make_shared<FutureState<T>>()) {}
+      ~Owner() { state->abandon(); }
+      std::shared_ptr<FutureState<T>> state;
+    };
+
+    std::shared_ptr<Owner> owner_;
+};
+
+// ready with all values (in order) once all futures are, or with the first
+// exception any of them gets
+template <class T>
+Future<std::vector<T>> when_all(std::vector<Future<T>> futures) {
+  struct All {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<T>> values;
+    size_t remaining;
+    bool done;
+    Promise<std::vector<T>> promise;
+  };
+  auto all = std::make_shared<All>();
+  Future<std::vector<T>> result = all->promise.get_future();
+  all->values.resize(futures.size());
+  all->remaining = futures.size();
+  all->done = false;
+  if (futures.empty())
+    all->promise.set_value(std::vector<T>());
+  for (size_t i=0; i<futures.size(); ++i) {
+    std::shared_ptr<FutureState<T>> state = std::move(futures[i].state_);
+    FutureState<T>* source = state.get();
+    source->setContinuation([all, state, i]() {
+      std::exception_ptr error = state->error();
+      std::vector<T> values;
+      {
+        std::lock_guard<std::mutex> lock(all->mutex);
+        if (all->done)
+          return;
+        if (!error) {
+          all->values[i].reset(new T(state->takeValue()));
+          if (--all->remaining != 0)
+            return;
+          for (auto& value : all->values)
+            values.push_back(std::move(*value));
+        }
+        all->done = true;
+      }
+      if (error)
+        all->promise.set_exception(error);
+      else
+        all->promise.set_value(std::move(values));
+    });
+  }
+  return result;
+}
+
+// ready with (index, value) of whichever future is first, or its exception.
+// Throws invalid_argument for no futures, there'd never be a first one.
+template <class T>
+Future<std::pair<size_t, T>> when_any(std::vector<Future<T>> futures) {
+  if (futures.empty())
+    throw std::invalid_argument("when_any needs at least one future");
+  struct Any {
+    Any() : done(false) {}
+    std::atomic<bool> done;
+    Promise<std::pair<size_t, T>> promise;
+  };
+  auto any = std::make_shared<Any>();
+  Future<std::pair<size_t, T>> result = any->promise.get_future();
+  for (size_t i=0; i<futures.size(); ++i) {
+    std::shared_ptr<FutureState<T>> state = std::move(futures[i].state_);
+    FutureState<T>* source = state.get();
+    source->setContinuation([any, state, i]() {
+      if (any->done.exchange(true))
+        return;
+      try {
+        any->promise.set_value(std::make_pair(i, state->takeValue()));
+      }
+      catch (...) {
+        any->promise.set_exception(std::current_exception());
+      }
+    });
+  }
+  return result;
+}
@@ -12,6 +12,7 @@ void play_with_move();
 void play_with_stl();
 void play_with_mpl();
 void play_with_threading();
+void play_with_coroutines();
 void variadic_template_func();
 
 int main() {
@@ -25,6 +26,7 @@ int main() {
     play_with_stl();
     play_with_mpl();
     play_with_threading();
+    play_with_coroutines();
 		cout << "exiting main()" << endl;
   }
   catch (const std::exception& ex) {
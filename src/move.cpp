@@ -15,27 +15,37 @@
 #include <algorithm> // std::transform
 #include <cassert>
 #include <string>
+#include <map>
+#include <chrono>
+#include <iomanip>
+
+#include "perf_counters.h"
+#include "alloc_tracker.h"
+#include "expr_vector.h"
+#include "small_vector.h"
 
 using namespace std;
 
 namespace {
 
-// example class for testing move c'tors, not doing anything useful
-class A {
+// example class for testing move c'tors, not doing anything useful. Storage
+// is vector<int> or small_vector<int, N>, to compare their heap usage.
+template <class Storage>
+class BasicA {
   public:
 
-    explicit A(int elemN) : wasSalvagedByMoveCtor(false) { 
+    explicit BasicA(int elemN) : wasSalvagedByMoveCtor(false) { 
       cout << "A ctor size=" << elemN << "\n"; 
       for (int i=0; i < elemN; ++i)
         data.push_back(i);
     }
 
-    ~A() { 
+    ~BasicA() { 
       cout << "A dtor size=" << data.size() << " wasSalvagedByMoveCtor=" << wasSalvagedByMoveCtor << "\n"; 
     }
 
-    A(const A& rhs) : wasSalvagedByMoveCtor(false) {
-      ++copyCount;
+    BasicA(const BasicA& rhs) : wasSalvagedByMoveCtor(false) {
+      trackCopy<BasicA>();
       cout << "A copy ctor size=" << rhs.data.size() << "\n"; 
       assert(!wasSalvagedByMoveCtor && !rhs.wasSalvagedByMoveCtor);
       data = rhs.data; // expensive, is not a move
@@ -47,21 +57,21 @@ class A {
     }
 
     // same thing as 'A& operator= (const A& rhs) = default', except it also logs
-    A& operator= (const A& rhs) {
-      ++copyCount;
+    BasicA& operator= (const BasicA& rhs) {
+      trackCopy<BasicA>();
       cout << "A copy op size=" << rhs.data.size() << "\n"; 
       data = rhs.data;
       return *this;
     }
 
-    static A create_retByValue() {
-      return A(3);
+    static BasicA create_retByValue() {
+      return BasicA(3);
     }
 
 #define CONFIG_ENABLE_MOVE_CTOR // comment out this line to test with or w/o move c'tor
 #if defined(CONFIG_ENABLE_MOVE_CTOR)
-    A(A&& rhs) : wasSalvagedByMoveCtor(false) {
-      ++moveCount;
+    BasicA(BasicA&& rhs) : wasSalvagedByMoveCtor(false) {
+      trackMove<BasicA>();
       cout << "A move ctor\n"; 
       assert(!wasSalvagedByMoveCtor && !rhs.wasSalvagedByMoveCtor);
       swap(data, rhs.data);
@@ -71,9 +81,9 @@ class A {
 
     // Vector add.
     // The longer vector is cut back to the size of the shorter one.
-    static A add_argsByValue_retByValue(A a, A b) {
+    static BasicA add_argsByValue_retByValue(BasicA a, BasicA b) {
       assert(!a.wasSalvagedByMoveCtor && !b.wasSalvagedByMoveCtor);
-      A result(0);
+      BasicA result(0);
       auto minSize = min(a.data.size(), b.data.size());
       result.data.reserve(minSize);
       std::transform(a.data.begin(), a.data.end(), b.data.begin(), 
@@ -82,9 +92,9 @@ class A {
     }
 
     // same impl, except params passed by ref
-    static A add_argsByRef_retByValue(const A& a, const A& b) {
+    static BasicA add_argsByRef_retByValue(const BasicA& a, const BasicA& b) {
       assert(!a.wasSalvagedByMoveCtor && !b.wasSalvagedByMoveCtor);
-      A result(0);
+      BasicA result(0);
       auto minSize = min(a.data.size(), b.data.size());
       result.data.reserve(minSize);
       std::transform(a.data.begin(), a.data.end(), b.data.begin(), 
@@ -92,63 +102,167 @@ class A {
       return result;
     }
 
+    // The hw counters show what the copies cost beyond their count (though
+    // for vectors this small all the cout logging dwarfs them), the heap
+    // counts which of the copies had to allocate.
     static void logAndResetCopyCount() {
-      cout << "summary: copyCount=" << copyCount << " moveCount=" << moveCount << endl;
-      copyCount = 0;
-      moveCount = 0;
+      TrackingStats stats = tracking().stats();
+      cout << "summary: copyCount=" << stats.template copies<BasicA>() << " moveCount=" << stats.template moves<BasicA>() << endl;
+      cout << "  heap: ";
+      stats.print(cout);
+      cout << endl;
+      cout << "  perf: " << perfCounters().stop().summary() << endl;
+      scenarioAllocs().push_back(make_pair(scenario(), stats.allocN));
+      resetCounts();
+    }
+
+    // prints the scenario's title, its allocations get recorded under it
+    static void beginScenario(const char* title) {
+      cout << "\n" << title << "\n";
+      scenario() = title;
+    }
+
+    // (scenario title, allocations) in the order logAndResetCopyCount() saw them
+    static vector<pair<const char*, uint64_t>>& scenarioAllocs() {
+      static vector<pair<const char*, uint64_t>> allocs;
+      return allocs;
+    }
+
+    static void resetCounts() {
+      tracking().reset();
+      perfCounters().start();
     }
 
   private:
-    vector<int> data;
+    Storage data;
     bool wasSalvagedByMoveCtor;
-    
-    static int copyCount;
-    static int moveCount;
+
+    // not a string, so that setting it doesn't allocate
+    static const char*& scenario() {
+      static const char* title = "";
+      return title;
+    }
+
+    static TrackingRegion& tracking() {
+      static TrackingRegion region("A", false);
+      return region;
+    }
+
+    static PerfCounters& perfCounters() {
+      static PerfCounters counters;
+      return counters;
+    }
 };
 
-int A::moveCount = 0;
-int A::copyCount = 0;
+typedef BasicA<vector<int>> VectorA;
+typedef BasicA<small_vector<int, 20>> SmallA; // room for all the A sizes below
 
 }
 
+template <class A>
 int func_argByValue(const A a) {
   return a.f();
 }
 
+template <class A>
 int func_argByRef(const A& a) {
   return a.f();
 }
 
+template <class A>
 int func_argByRvalueRef(const A&& a) {
   return a.f();
 }
 
 /* this makes compilation ambiguous
+template <class A>
 int fOverloaded(A a) {
   cout << "fOverloaded A\n";
   return a.f();
 }
 */
 
+template <class A>
 int fOverloaded(const A& a) {
   cout << "fOverloaded A&\n";
   return a.f();
 }
 
+template <class A>
 int fOverloaded(const A&& a) {
   cout << "fOverloaded A&&\n";
   return a.f();
 }
 
-void play_with_move() {
+// A::add_argsByRef_retByValue minus the logging: a new vector per +
+vector<int> addByTransform(const vector<int>& a, const vector<int>& b) {
+  vector<int> result;
+  auto minSize = min(a.size(), b.size());
+  result.reserve(minSize);
+  std::transform(a.begin(), a.begin() + minSize, b.begin(), std::back_inserter(result), std::plus<int>());
+  return result;
+}
+
+// r = a + b + c the A way (a temporary per operator), as a hand-written
+// loop and via expression templates, with allocations counted by a
+// TrackingRegion
+void benchmarkExpressionTemplates() {
+  const size_t n = 1 << 20;
+  const int repeatN = 50;
+  cout << "\nr = a + b + c on " << n << " ints\n";
+  cout << setw(24) << "" << setw(14) << "allocs/expr" << setw(14) << "Melems/s" << '\n';
+  auto report = [repeatN, n](const char* name, function<void()> expression) {
+    expression(); // warm up, and lets the destinations allocate up front
+    TrackingRegion region(name, false);
+    auto t0 = chrono::steady_clock::now();
+    for (int i=0; i<repeatN; ++i)
+      expression();
+    auto seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    cout << setw(24) << name << fixed << setprecision(1) << setw(14) << double(region.stats().allocN) / repeatN
+         << setw(14) << n * repeatN / seconds / 1e6 << '\n';
+    cout.unsetf(ios::floatfield);
+  };
+
+  vector<int> a(n), b(n), c(n), r;
+  for (size_t i=0; i<n; ++i) {
+    a[i] = static_cast<int>(i);
+    b[i] = static_cast<int>(2 * i);
+    c[i] = static_cast<int>(3 * i);
+  }
+  report("transform temporaries", [&]() { r = addByTransform(addByTransform(a, b), c); });
+  const int expected = r[n - 1];
+
+  vector<int> loopR(n);
+  report("hand-written loop", [&]() {
+    for (size_t i=0; i<n; ++i)
+      loopR[i] = a[i] + b[i] + c[i];
+  });
+
+  ExprVector<int> ea(n), eb(n), ec(n), er;
+  for (size_t i=0; i<n; ++i) {
+    ea[i] = a[i];
+    eb[i] = b[i];
+    ec[i] = c[i];
+  }
+  report("expression template", [&]() { er = ea + eb + ec; });
+
+  if (loopR[n - 1] != expected || er[n - 1] != expected)
+    cout << "benchmarkExpressionTemplates: results differ\n";
+}
 
-  cout << "\nexample A ctor\n";
+// All the ways of passing & returning A, with copies, moves & allocations
+// logged per scenario.
+template <class A>
+void moveScenarios() {
+  A::resetCounts();
+
+  A::beginScenario("example A ctor");
   {
     A a(10);
   }
   A::logAndResetCopyCount();
 
-  cout << "\nexample create_byValue\n";
+  A::beginScenario("example create_byValue");
   {
     A a(A::create_retByValue());
     a.f();
@@ -157,7 +271,7 @@ void play_with_move() {
 
   // Here the args that are being passed are copy constructed, making
   // this an expensive & slow operation.
-  cout << "\nexample add_argsByValue_retByValue\n";
+  A::beginScenario("example add_argsByValue_retByValue");
   {
     A a(10);
     A b(20);
@@ -167,14 +281,14 @@ void play_with_move() {
 
   // note that here despite passing args by value VS2012 generates no copy c'tor calls,
   // so number of mem operations is minimal
-  cout << "\nexample add_argsByValue_retByValue with inline constructed args\n";
+  A::beginScenario("example add_argsByValue_retByValue with inline constructed args");
   {
     auto sum = A::add_argsByValue_retByValue(A(10), A(20));
   }
   A::logAndResetCopyCount();
 
   // Passing args by const ref is still superior in C++11:
-  cout << "\nexample add_argsByRef_retByValue\n";
+  A::beginScenario("example add_argsByRef_retByValue");
   {
     A a(10);
     A b(20);
@@ -182,7 +296,7 @@ void play_with_move() {
   }
   A::logAndResetCopyCount();
 
-  cout << "\nexample add_argsByRef_retByValue with inline constructed args\n";
+  A::beginScenario("example add_argsByRef_retByValue with inline constructed args");
   {
     auto sum = A::add_argsByRef_retByValue(A(10), A(20));
   }
@@ -190,19 +304,19 @@ void play_with_move() {
 
 
 
-  cout << "\nfunc_argByValue\n";
+  A::beginScenario("func_argByValue");
   {
     func_argByValue(A(6));
   }
   A::logAndResetCopyCount();
 
-  cout << "\nfunc_argByRef\n";
+  A::beginScenario("func_argByRef");
   {
     func_argByRef(A(6));
   }
   A::logAndResetCopyCount();
 
-  cout << "\nfunc_argByRvalueRef\n";
+  A::beginScenario("func_argByRvalueRef");
   {
     func_argByRvalueRef(A(6));
   }
@@ -210,14 +324,14 @@ void play_with_move() {
 
 
 
-  cout << "\nfunc_argByValue, lvalue arg\n";
+  A::beginScenario("func_argByValue, lvalue arg");
   {
     A a(7);
     func_argByValue(a);
   }
   A::logAndResetCopyCount();
 
-  cout << "\nfunc_argByRef, lvalue arg\n";
+  A::beginScenario("func_argByRef, lvalue arg");
   {
     A a(7);
     func_argByRef(a);
@@ -225,7 +339,7 @@ void play_with_move() {
   A::logAndResetCopyCount();
 
   /* doesn't compile, since a is not an rvalue
-  cout << "\nfunc_argByRvalueRef, lvalue arg\n";
+  A::beginScenario("func_argByRvalueRef, lvalue arg");
   {
     A a(7);
     func_argByRvalueRef(a);
@@ -233,11 +347,11 @@ void play_with_move() {
   A::logAndResetCopyCount();
   */
 
- cout << "\nfOverloaded(A(8))\n";
+ A::beginScenario("fOverloaded(A(8))");
  {
     fOverloaded(A(8));
   }
- cout << "\nfOverloaded(a)\n";
+ A::beginScenario("fOverloaded(a)");
   {
     A a(9);
     fOverloaded(a);
@@ -245,5 +359,53 @@ void play_with_move() {
 
   A::logAndResetCopyCount();
 
-  //xxx TODO test vector<A>
+  // A's move ctor isn't noexcept, so vector copies rather than moves its
+  // elements whenever it grows
+  A::beginScenario("vector<A> growing");
+  {
+    vector<A> as;
+    for (int i=0; i<3; ++i)
+      as.push_back(A(i + 1));
+  }
+  A::logAndResetCopyCount();
+}
+
+void play_with_move() {
+  cout << "\nA with vector<int> storage\n";
+  moveScenarios<VectorA>();
+  cout << "\nA with small_vector<int, 20> storage\n";
+  moveScenarios<SmallA>();
+
+  cout << "\nallocations per scenario\n";
+  cout << left << setw(64) << "" << right << setw(8) << "vector" << setw(14) << "small_vector" << '\n';
+  for (size_t i=0; i<VectorA::scenarioAllocs().size(); ++i)
+    cout << left << setw(64) << VectorA::scenarioAllocs()[i].first << right << setw(8) << VectorA::scenarioAllocs()[i].second
+         << setw(14) << SmallA::scenarioAllocs()[i].second << '\n';
+  cout << '\n';
+
+  // the same kind of hidden copies for a type without hand-written copy ops:
+  // the pair type not matching map's value_type (const key) makes every
+  // iteration copy into a temporary (which newer compilers warn about)
+  struct Entry {
+    string value;
+    CopyMoveTracked<Entry> tracked;
+  };
+  map<string, Entry> entries;
+  entries["first key, too long for the small string buffer"].value = "first value, also too long for it";
+  entries["second key, too long for the small string buffer"].value = "second value, also too long for it";
+  cout << "\n";
+  size_t length = 0;
+  {
+    TrackingRegion region("range-for over map, const pair<string, Entry>&");
+    for (const pair<string, Entry>& entry : entries)
+      length += entry.second.value.size();
+  }
+  {
+    TrackingRegion region("range-for over map, const auto&");
+    for (const auto& entry : entries)
+      length += entry.second.value.size();
+  }
+  cout << "total length " << length << "\n";
+
+  benchmarkExpressionTemplates();
 }
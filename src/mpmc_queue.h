@@ -0,0 +1,232 @@
+// Bounded lock-free multi-producer/multi-consumer FIFO queue, after Dmitry
+// Vyukov's http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+//
+// Each cell carries a sequence number telling whether it's ready for the
+// producer or the consumer of a given lap around the ring, so push and pop
+// each cost one CAS on their index plus one store to the cell, and
+// producers and consumers only contend with their own kind. The two
+// indices live on separate cache lines, otherwise every push would bounce
+// the consumers' line too (see MemBandwidthTest --contention). So does
+// each cell, else a producer filling cell i would invalidate the line a
+// consumer is reading cell i-1 from. That costs 64 bytes per cell, 64 KiB
+// for the 1024 cells of benchmarkQueues().
+//
+// MpmcQueue never blocks, BlockingMpmcQueue parks consumers on an empty
+// queue and producers on a full one. See benchmarkQueues() in threading.cpp
+// for a comparison against the mutex+condvar ProducerConsumer.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint> // intptr_t
+#include <new>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <stdexcept>
+
+#include "cache_aligned.h"
+
+template <class T>
+class MpmcQueue {
+  public:
+    // capacity gets rounded up to a power of 2
+    explicit MpmcQueue(size_t capacity)
+        : mask_(roundUpToPowerOf2(capacity) - 1),
+          storage_(new char[(mask_ + 1) * sizeof(Cell) + cacheLineSize]),
+          cells_(alignToCacheLine(storage_.get())) {
+      for (size_t i=0; i<=mask_; ++i) {
+        new (cells_ + i) Cell();
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+      }
+      enqueuePos_.store(0, std::memory_order_relaxed);
+      dequeuePos_.store(0, std::memory_order_relaxed);
+    }
+
+    ~MpmcQueue() {
+      for (size_t i=0; i<=mask_; ++i)
+        cells_[i].~Cell();
+    }
+
+    size_t capacity() const { return mask_ + 1; }
+
+    // returns false if the queue is full
+    bool tryPush(const T& item) {
+      size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+      for (;;) {
+        Cell& cell = cells_[pos & mask_];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        if (diff == 0) { // cell is free for this lap, try to claim it
+          if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            cell.data = item;
+            cell.sequence.store(pos + 1, std::memory_order_release);
+            return true;
+          }
+          // pos got reloaded by the failed CAS
+        }
+        else if (diff < 0) { // cell still holds the item of the previous lap
+          return false;
+        }
+        else { // another producer claimed pos already
+          pos = enqueuePos_.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    // returns false if the queue is empty
+    bool tryPop(T& item) {
+      size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+      for (;;) {
+        Cell& cell = cells_[pos & mask_];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+        if (diff == 0) { // cell was filled in this lap, try to claim it
+          if (dequeuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            item = std::move(cell.data);
+            cell.sequence.store(pos + mask_ + 1, std::memory_order_release); // free for the next lap
+            return true;
+          }
+        }
+        else if (diff < 0) { // not filled yet
+          return false;
+        }
+        else { // another consumer claimed pos already
+          pos = dequeuePos_.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+  private:
+    MpmcQueue(const MpmcQueue&); // = delete, but vs2012
+    MpmcQueue& operator=(const MpmcQueue&);
+
+    struct CellData {
+      std::atomic<size_t> sequence;
+      T data;
+    };
+    // Padded to a multiple of the line size by hand, since alignas wouldn't
+    // be honored by new before C++17. A whole line more if it's a multiple
+    // already, a zero-length array isn't legal.
+    struct Cell : CellData {
+      char padding[cacheLineSize - sizeof(CellData) % cacheLineSize];
+    };
+
+    static Cell* alignToCacheLine(char* p) {
+      const uintptr_t address = reinterpret_cast<uintptr_t>(p);
+      return reinterpret_cast<Cell*>(p + (cacheLineSize - address % cacheLineSize) % cacheLineSize);
+    }
+
+    static size_t roundUpToPowerOf2(size_t n) {
+      if (n < 2)
+        throw std::invalid_argument("MpmcQueue capacity must be >= 2");
+      size_t result = 1;
+      while (result < n)
+        result *= 2;
+      return result;
+    }
+
+    const size_t mask_; // capacity - 1
+    std::unique_ptr<char[]> storage_;
+    Cell* const cells_; // within storage_, on a cache line boundary
+    // each index on its own cache line
+    alignas(cacheLineSize) std::atomic<size_t> enqueuePos_;
+    alignas(cacheLineSize) std::atomic<size_t> dequeuePos_;
+    char padding_[cacheLineSize - sizeof(std::atomic<size_t>)];
+};
+
+// MpmcQueue plus blocking push/pop. Consumers spin briefly on an empty
+// queue and then park on a condvar, same for producers on a full one. The
+// mutex only gets touched on the way into parking and when someone is
+// actually parked, so the steady state stays lock-free.
+template <class T>
+class BlockingMpmcQueue {
+  public:
+    explicit BlockingMpmcQueue(size_t capacity) : queue_(capacity) {}
+
+    void push(const T& item) {
+      if (!spinUntil([&]{ return queue_.tryPush(item); }))
+        park(producers_, [&]{ return queue_.tryPush(item); });
+      wakeOne(consumers_);
+    }
+
+    T pop() {
+      T item;
+      if (!spinUntil([&]{ return queue_.tryPop(item); }))
+        park(consumers_, [&]{ return queue_.tryPop(item); });
+      wakeOne(producers_);
+      return item;
+    }
+
+    bool tryPush(const T& item) {
+      if (!queue_.tryPush(item))
+        return false;
+      wakeOne(consumers_);
+      return true;
+    }
+
+    bool tryPop(T& item) {
+      if (!queue_.tryPop(item))
+        return false;
+      wakeOne(producers_);
+      return true;
+    }
+
+  private:
+    BlockingMpmcQueue(const BlockingMpmcQueue&); // = delete, but vs2012
+    BlockingMpmcQueue& operator=(const BlockingMpmcQueue&);
+
+    // threads of one side waiting for the other
+    struct Parking {
+      Parking() : parkedN(0), wakePendingN(0) {}
+      std::atomic<int> parkedN;
+      int wakePendingN; // notified but not yet running again, guarded by mutex_
+      std::condition_variable condition;
+    };
+
+    // Spinning only pays off if whoever we wait for runs concurrently.
+    template <class Op>
+    static bool spinUntil(Op op) {
+      static const int spinN = std::thread::hardware_concurrency() > 1 ? 100 : 1;
+      for (int spin=0; spin<spinN; ++spin)
+        if (op())
+          return true;
+      return false;
+    }
+
+    // The fences here and in wakeOne() make sure that either the waker sees
+    // the parked count or the parked thread's op sees the waker's change.
+    template <class Op>
+    void park(Parking& parking, Op op) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      parking.parkedN.fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      while (!op()) {
+        parking.condition.wait(lock);
+        if (parking.wakePendingN > 0)
+          --parking.wakePendingN;
+      }
+      parking.parkedN.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Wakes a parked thread unless enough are already on their way, which
+    // on a busy box saves a futex syscall per item until the woken thread
+    // actually gets to run.
+    void wakeOne(Parking& parking) {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (parking.parkedN.load(std::memory_order_relaxed) == 0)
+        return;
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (parking.parkedN.load(std::memory_order_relaxed) > parking.wakePendingN) {
+        ++parking.wakePendingN;
+        parking.condition.notify_one();
+      }
+    }
+
+    MpmcQueue<T> queue_;
+    Parking consumers_;
+    Parking producers_;
+    std::mutex mutex_;
+};
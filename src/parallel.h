@@ -0,0 +1,178 @@
+// Parallel for, transform, reduce and sort on the work-stealing ThreadPool.
+//
+// All of them split their range in halves recursively until a chunk is at
+// most grainSize elements, forking one half as a pool task and doing the
+// other one right there, fib(n) style. Stealing then balances uneven chunks.
+// grainSize 0 picks a few chunks per pool thread, pass a bigger one if the
+// per-element work is tiny, a smaller one if it varies wildly.
+//
+// They run on sharedThreadPool() unless given a pool, and may be called
+// from within pool tasks (including nested) since waiting goes through
+// ThreadPool::join(). Exceptions from f or op propagate to the caller once
+// all forked chunks finished.
+// See benchmarkParallelAlgorithms() in threading.cpp.
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <future>
+
+#include "thread_pool.h"
+
+// one pool per process for everyone, as many threads as cores
+inline ThreadPool& sharedThreadPool() {
+  static ThreadPool pool;
+  return pool;
+}
+
+// 8 chunks per pool thread, so that there's something left to steal
+inline size_t autoGrainSize(size_t n, const ThreadPool& pool, size_t minGrainSize = 1) {
+  return std::max(minGrainSize, n / (8 * pool.size()));
+}
+
+// left() here, right() as a pool task, returns once both are done
+template <class Left, class Right>
+void forkJoin(ThreadPool& pool, Left left, Right right) {
+  std::future<void> rightDone = pool.submit(std::move(right));
+  try {
+    left();
+  }
+  catch (...) {
+    // right() may use our caller's locals, so wait for it no matter what
+    try { pool.join(rightDone); } catch (...) {}
+    throw;
+  }
+  pool.join(rightDone);
+}
+
+// f(chunkBegin, chunkEnd) for chunks of at most grainSize covering [begin, end)
+template <class F>
+void parallelForChunks(ThreadPool& pool, size_t begin, size_t end, size_t grainSize, const F& f) {
+  if (end - begin <= grainSize) {
+    f(begin, end);
+    return;
+  }
+  const size_t mid = begin + (end - begin) / 2;
+  forkJoin(pool,
+      [&]() { parallelForChunks(pool, begin, mid, grainSize, f); },
+      [&]() { parallelForChunks(pool, mid, end, grainSize, f); });
+}
+
+// f(i) for i in [begin, end), in no particular order
+template <class F>
+void parallel_for(size_t begin, size_t end, F f, size_t grainSize = 0, ThreadPool& pool = sharedThreadPool()) {
+  if (begin >= end)
+    return;
+  if (grainSize == 0)
+    grainSize = autoGrainSize(end - begin, pool);
+  parallelForChunks(pool, begin, end, grainSize, [&f](size_t chunkBegin, size_t chunkEnd) {
+    for (size_t i=chunkBegin; i<chunkEnd; ++i)
+      f(i);
+  });
+}
+
+// std::transform for random access iterators, returns the end of out
+template <class InIt, class OutIt, class F>
+OutIt parallel_transform(InIt first, InIt last, OutIt out, F f, size_t grainSize = 0, ThreadPool& pool = sharedThreadPool()) {
+  const size_t n = last - first;
+  parallel_for(0, n, [first, out, &f](size_t i) { out[i] = f(first[i]); }, grainSize, pool);
+  return out + n;
+}
+
+template <class It, class T, class Op>
+T reduceChunks(ThreadPool& pool, It first, size_t n, size_t grainSize, const Op& op) {
+  if (n <= grainSize) {
+    T result = first[0];
+    for (size_t i=1; i<n; ++i)
+      result = op(result, first[i]);
+    return result;
+  }
+  const size_t mid = n / 2;
+  T left = T(), right = T();
+  forkJoin(pool,
+      [&]() { left = reduceChunks<It, T>(pool, first, mid, grainSize, op); },
+      [&]() { right = reduceChunks<It, T>(pool, first + mid, n - mid, grainSize, op); });
+  return op(left, right);
+}
+
+// std::reduce, i.e. like std::accumulate except that op gets applied in no
+// particular grouping, so it needs to be associative (and T default
+// constructible). Floating point sums differ a bit from a serial loop's.
+template <class It, class T, class Op>
+T parallel_reduce(It first, It last, T init, Op op, size_t grainSize = 0, ThreadPool& pool = sharedThreadPool()) {
+  const size_t n = last - first;
+  if (n == 0)
+    return init;
+  if (grainSize == 0)
+    grainSize = autoGrainSize(n, pool);
+  return op(init, reduceChunks<It, T>(pool, first, n, grainSize, op));
+}
+
+template <class It, class T>
+T parallel_reduce(It first, It last, T init) {
+  return parallel_reduce(first, last, init, std::plus<T>());
+}
+
+// Merges sorted [first1, last1) & [first2, last2) into out by splitting the
+// bigger range in the middle and the other one at the matching position,
+// so both halves of the merge can run in parallel.
+template <class It, class OutIt, class Compare>
+void parallelMerge(ThreadPool& pool, It first1, It last1, It first2, It last2, OutIt out,
+                   const Compare& comp, size_t grainSize) {
+  const size_t n1 = last1 - first1, n2 = last2 - first2;
+  if (n1 + n2 <= grainSize) {
+    std::merge(std::make_move_iterator(first1), std::make_move_iterator(last1),
+               std::make_move_iterator(first2), std::make_move_iterator(last2), out, comp);
+    return;
+  }
+  It mid1, mid2;
+  if (n1 >= n2) {
+    mid1 = first1 + n1 / 2;
+    mid2 = std::lower_bound(first2, last2, *mid1, comp);
+  }
+  else {
+    mid2 = first2 + n2 / 2;
+    mid1 = std::upper_bound(first1, last1, *mid2, comp);
+  }
+  OutIt outMid = out + (mid1 - first1) + (mid2 - first2);
+  forkJoin(pool,
+      [&]() { parallelMerge(pool, first1, mid1, first2, mid2, out, comp, grainSize); },
+      [&]() { parallelMerge(pool, mid1, last1, mid2, last2, outMid, comp, grainSize); });
+}
+
+// sorts [first, last) with buffer as scratch space of the same size
+template <class It, class BufferIt, class Compare>
+void mergeSort(ThreadPool& pool, It first, It last, BufferIt buffer, const Compare& comp, size_t grainSize) {
+  const size_t n = last - first;
+  if (n <= grainSize) {
+    std::sort(first, last, comp);
+    return;
+  }
+  const size_t mid = n / 2;
+  forkJoin(pool,
+      [&]() { mergeSort(pool, first, first + mid, buffer, comp, grainSize); },
+      [&]() { mergeSort(pool, first + mid, last, buffer + mid, comp, grainSize); });
+  parallelMerge(pool, first, first + mid, first + mid, last, buffer, comp, grainSize);
+  parallelForChunks(pool, 0, n, grainSize, [first, buffer](size_t chunkBegin, size_t chunkEnd) {
+    std::move(buffer + chunkBegin, buffer + chunkEnd, first + chunkBegin);
+  });
+}
+
+// Merge sort, std::sort within chunks, merges split up in parallel too.
+// Needs n elements of extra memory and, like std::sort, isn't stable.
+template <class It, class Compare = std::less<typename std::iterator_traits<It>::value_type>>
+void parallel_sort(It first, It last, Compare comp = Compare(), size_t grainSize = 0,
+                   ThreadPool& pool = sharedThreadPool()) {
+  const size_t n = last - first;
+  if (n < 2)
+    return;
+  if (grainSize == 0)
+    grainSize = autoGrainSize(n, pool, 4096);
+  grainSize = std::max<size_t>(grainSize, 2); // a merge of 1 + 1 elements can't be split
+  std::vector<typename std::iterator_traits<It>::value_type> buffer(n);
+  mergeSort(pool, first, last, buffer.begin(), comp, grainSize);
+}
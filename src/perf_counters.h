@@ -0,0 +1,180 @@
+// Hardware performance counters around a measured region, via Linux
+// perf_event_open(2). Shared by play (see move.cpp) and MemBandwidthTest.
+//
+// Counts the calling thread in user space only, which works with the
+// default perf_event_paranoid=2. Each counter is opened on its own rather
+// than as a group, so that one the cpu (or the VM) doesn't offer doesn't
+// take the others down with it; such counters just read as unavailable.
+// When the kernel multiplexes counters the counts get scaled by
+// time_enabled/time_running. Off Linux all counters are unavailable.
+//
+// Usage:
+//   PerfCounters counters;
+//   counters.start();
+//   ... measured region ...
+//   cout << counters.stop().summary() << '\n';
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <sstream>
+#include <ostream>
+#ifdef __linux__
+#include <cstring> // memset
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+enum class PerfEvent {
+  Cycles,
+  Instructions,
+  LlcMisses, // last level cache misses, i.e. trips to DRAM (or a remote node)
+  DtlbMisses, // data TLB load misses, each one is a page walk
+  BackendStalls, // cycles stalled in the backend, mostly waiting on memory
+};
+const int perfEventN = 5;
+
+// result of one measured region, or the sum of several (e.g. of all threads)
+struct PerfCounts {
+  std::array<uint64_t, perfEventN> values;
+  std::array<bool, perfEventN> valid;
+
+  PerfCounts() {
+    values.fill(0);
+    valid.fill(false);
+  }
+
+  bool has(PerfEvent event) const { return valid[static_cast<int>(event)]; }
+  uint64_t operator[](PerfEvent event) const { return values[static_cast<int>(event)]; }
+
+  bool empty() const {
+    for (bool v : valid)
+      if (v)
+        return false;
+    return true;
+  }
+
+  PerfCounts& operator+=(const PerfCounts& rhs) {
+    for (int i=0; i<perfEventN; ++i) {
+      values[i] += rhs.values[i];
+      valid[i] = valid[i] || rhs.valid[i];
+    }
+    return *this;
+  }
+
+  static const char* name(PerfEvent event) {
+    static const char* names[perfEventN] = { "cycles", "instructions", "llcMisses", "dtlbMisses", "backendStalls" };
+    return names[static_cast<int>(event)];
+  }
+
+  // e.g. "cycles=123 instructions=456 ipc=3.7 llcMisses=7 backendStalls=12 (9.8% of cycles)"
+  std::string summary() const {
+    if (empty())
+      return "perf counters unavailable";
+    std::ostringstream out;
+    for (int i=0; i<perfEventN; ++i) {
+      PerfEvent event = static_cast<PerfEvent>(i);
+      if (!has(event))
+        continue;
+      out << (out.tellp() == 0 ? "" : " ") << name(event) << '=' << (*this)[event];
+      if (event == PerfEvent::Instructions && has(PerfEvent::Cycles) && (*this)[PerfEvent::Cycles] != 0)
+        out << " ipc=" << static_cast<double>((*this)[event]) / (*this)[PerfEvent::Cycles];
+      if (event == PerfEvent::BackendStalls && has(PerfEvent::Cycles) && (*this)[PerfEvent::Cycles] != 0)
+        out << " (" << 100.0 * (*this)[event] / (*this)[PerfEvent::Cycles] << "% of cycles)";
+    }
+    return out.str();
+  }
+};
+
+// the counter fds of the thread that constructed it
+class PerfCounters {
+  public:
+    PerfCounters() {
+      fds_.fill(-1);
+#ifdef __linux__
+      const uint64_t l1dTlbReadMiss = PERF_COUNT_HW_CACHE_DTLB
+        | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      const struct { uint32_t type; uint64_t config; } events[perfEventN] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+        { PERF_TYPE_HW_CACHE, l1dTlbReadMiss },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND },
+      };
+      for (int i=0; i<perfEventN; ++i) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds_[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0 /*this thread*/, -1 /*any cpu*/, -1, 0));
+      }
+#endif
+    }
+
+    ~PerfCounters() {
+#ifdef __linux__
+      for (int fd : fds_)
+        if (fd >= 0)
+          close(fd);
+#endif
+    }
+
+    void start() {
+#ifdef __linux__
+      for (int fd : fds_) {
+        if (fd >= 0) {
+          ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+          ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+      }
+#endif
+    }
+
+    PerfCounts stop() {
+      PerfCounts counts;
+#ifdef __linux__
+      for (int fd : fds_)
+        if (fd >= 0)
+          ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      for (int i=0; i<perfEventN; ++i) {
+        uint64_t data[3]; // value, time enabled, time running
+        if (fds_[i] < 0 || read(fds_[i], data, sizeof(data)) != sizeof(data) || data[2] == 0)
+          continue;
+        counts.values[i] = data[2] == data[1] ? data[0]
+          : static_cast<uint64_t>(static_cast<double>(data[0]) * data[1] / data[2]);
+        counts.valid[i] = true;
+      }
+#endif
+      return counts;
+    }
+
+  private:
+    PerfCounters(const PerfCounters&); // = delete, but vs2012
+    PerfCounters& operator=(const PerfCounters&);
+
+    std::array<int, perfEventN> fds_;
+};
+
+// Counts its own lifetime and prints the counts on destruction, for
+// measuring a { block }.
+class PerfScope {
+  public:
+    explicit PerfScope(std::ostream& out) : out_(out) { counters_.start(); }
+    ~PerfScope() { out_ << "perf: " << counters_.stop().summary() << '\n'; }
+
+  private:
+    PerfScope(const PerfScope&); // = delete, but vs2012
+    PerfScope& operator=(const PerfScope&);
+
+    std::ostream& out_;
+    PerfCounters counters_;
+};
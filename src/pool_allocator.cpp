@@ -0,0 +1,217 @@
+// Size class pools with thread-local caches, see pool_allocator.h.
+//
+// Free blocks are linked through their first bytes. In the global pool the
+// first block of each batch also links to the next batch, so fetching and
+// returning a batch is O(1) under the lock.
+
+#include "pool_allocator.h"
+#include "adaptive_mutex.h"
+
+#include <mutex>
+
+using namespace std;
+
+namespace {
+
+const size_t classN = poolMaxBytes / poolAlignment;
+const size_t batchesPerSlab = 8;
+
+struct FreeBlock {
+  FreeBlock* next;
+  FreeBlock* nextBatch; // global pool only, on the first block of a batch
+};
+static_assert(sizeof(FreeBlock) <= poolAlignment, "blocks must be able to hold a FreeBlock");
+
+size_t sizeClass(size_t bytes) {
+  return (bytes + poolAlignment - 1) / poolAlignment - 1;
+}
+
+size_t classBytes(size_t sizeClass) {
+  return (sizeClass + 1) * poolAlignment;
+}
+
+class GlobalPool {
+  public:
+    GlobalPool() : slabBytes_(0), batchFetchN_(0), batchReturnN_(0) {
+      for (size_t i=0; i<classN; ++i) {
+        batches_[i] = nullptr;
+        freeBlockN_[i] = 0;
+      }
+    }
+
+    // a batch of up to poolBatchSize blocks, linked via next
+    FreeBlock* fetchBatch(size_t sizeClass, size_t& blockN) {
+      lock_guard<AdaptiveMutex> lock(mutex_);
+      if (batches_[sizeClass] == nullptr)
+        carveSlab(sizeClass);
+      FreeBlock* batch = batches_[sizeClass];
+      batches_[sizeClass] = batch->nextBatch;
+      blockN = batchLength(batch);
+      freeBlockN_[sizeClass] -= blockN;
+      ++batchFetchN_;
+      return batch;
+    }
+
+    // takes blocks linked via next, ending in nullptr
+    void returnBatch(size_t sizeClass, FreeBlock* batch, size_t blockN) {
+      lock_guard<AdaptiveMutex> lock(mutex_);
+      batch->nextBatch = batches_[sizeClass];
+      batches_[sizeClass] = batch;
+      freeBlockN_[sizeClass] += blockN;
+      ++batchReturnN_;
+    }
+
+    PoolStats stats() {
+      lock_guard<AdaptiveMutex> lock(mutex_);
+      PoolStats stats = { slabBytes_, 0, batchFetchN_, batchReturnN_ };
+      for (size_t i=0; i<classN; ++i)
+        stats.globalFreeBlocks += freeBlockN_[i];
+      return stats;
+    }
+
+  private:
+    GlobalPool(const GlobalPool&); // = delete, but vs2012
+    GlobalPool& operator=(const GlobalPool&);
+
+    // Batches returned by threads may be shorter than poolBatchSize, so we
+    // count rather than keep a length per batch. Walking them only touches
+    // blocks the fetching thread is about to use anyway.
+    static size_t batchLength(FreeBlock* batch) {
+      size_t n = 0;
+      for (; batch != nullptr; batch = batch->next)
+        ++n;
+      return n;
+    }
+
+    void carveSlab(size_t sizeClass) {
+      const size_t blockBytes = classBytes(sizeClass);
+      const size_t bytes = batchesPerSlab * poolBatchSize * blockBytes;
+      char* slab = static_cast<char*>(::operator new(bytes)); // 16 byte aligned like malloc
+      slabBytes_ += bytes;
+      for (size_t batch=0; batch<batchesPerSlab; ++batch) {
+        char* first = slab + batch * poolBatchSize * blockBytes;
+        for (size_t i=0; i<poolBatchSize; ++i) {
+          FreeBlock* block = reinterpret_cast<FreeBlock*>(first + i * blockBytes);
+          block->next = i + 1 < poolBatchSize ? reinterpret_cast<FreeBlock*>(first + (i + 1) * blockBytes) : nullptr;
+        }
+        FreeBlock* head = reinterpret_cast<FreeBlock*>(first);
+        head->nextBatch = batches_[sizeClass];
+        batches_[sizeClass] = head;
+      }
+      freeBlockN_[sizeClass] += batchesPerSlab * poolBatchSize;
+    }
+
+    AdaptiveMutex mutex_;
+    FreeBlock* batches_[classN];
+    size_t freeBlockN_[classN];
+    uint64_t slabBytes_;
+    uint64_t batchFetchN_;
+    uint64_t batchReturnN_;
+};
+
+// Never destroyed, since static dtors (and other threads) may still free
+// nodes after ours would have run.
+GlobalPool& globalPool() {
+  static GlobalPool* pool = new GlobalPool;
+  return *pool;
+}
+
+class ThreadCache {
+  public:
+    ThreadCache() {
+      for (size_t i=0; i<classN; ++i) {
+        heads_[i] = nullptr;
+        blockN_[i] = 0;
+      }
+    }
+
+    ~ThreadCache() {
+      for (size_t i=0; i<classN; ++i)
+        if (heads_[i] != nullptr)
+          globalPool().returnBatch(i, heads_[i], blockN_[i]);
+      destroyed() = true;
+    }
+
+    void* allocate(size_t sizeClass) {
+      if (heads_[sizeClass] == nullptr)
+        heads_[sizeClass] = globalPool().fetchBatch(sizeClass, blockN_[sizeClass]);
+      FreeBlock* block = heads_[sizeClass];
+      heads_[sizeClass] = block->next;
+      --blockN_[sizeClass];
+      return block;
+    }
+
+    void deallocate(void* p, size_t sizeClass) {
+      FreeBlock* block = static_cast<FreeBlock*>(p);
+      block->next = heads_[sizeClass];
+      heads_[sizeClass] = block;
+      if (++blockN_[sizeClass] == 2 * poolBatchSize) {
+        // hand the older half back, keeping the recently freed (cache-hot) one
+        FreeBlock* last = block;
+        for (size_t i=1; i<poolBatchSize; ++i)
+          last = last->next;
+        FreeBlock* batch = last->next;
+        last->next = nullptr;
+        blockN_[sizeClass] = poolBatchSize;
+        globalPool().returnBatch(sizeClass, batch, poolBatchSize);
+      }
+    }
+
+    // After a thread's cache died, thread_local dtors that run later (of
+    // containers using PoolAllocator, say) go to the global pool directly.
+    // Plain bool, so it doesn't get destroyed itself.
+    static bool& destroyed() {
+      static thread_local bool destroyed = false;
+      return destroyed;
+    }
+
+  private:
+    FreeBlock* heads_[classN];
+    size_t blockN_[classN];
+};
+
+ThreadCache& threadCache() {
+  static thread_local ThreadCache cache;
+  return cache;
+}
+
+}
+
+void* poolAllocate(size_t bytes) {
+  if (bytes == 0)
+    bytes = 1;
+  if (bytes > poolMaxBytes)
+    return ::operator new(bytes);
+  const size_t cls = sizeClass(bytes);
+  if (ThreadCache::destroyed()) {
+    size_t blockN = 0;
+    FreeBlock* batch = globalPool().fetchBatch(cls, blockN);
+    if (batch->next != nullptr)
+      globalPool().returnBatch(cls, batch->next, blockN - 1);
+    return batch;
+  }
+  return threadCache().allocate(cls);
+}
+
+void poolDeallocate(void* p, size_t bytes) {
+  if (p == nullptr)
+    return;
+  if (bytes == 0)
+    bytes = 1;
+  if (bytes > poolMaxBytes) {
+    ::operator delete(p);
+    return;
+  }
+  const size_t cls = sizeClass(bytes);
+  if (ThreadCache::destroyed()) {
+    FreeBlock* block = static_cast<FreeBlock*>(p);
+    block->next = nullptr;
+    globalPool().returnBatch(cls, block, 1);
+    return;
+  }
+  threadCache().deallocate(p, cls);
+}
+
+PoolStats poolStats() {
+  return globalPool().stats();
+}
@@ -0,0 +1,71 @@
+// Pool allocation for node-based containers (list, forward_list, set, map,
+// ...), which otherwise make one trip to the global heap per insert.
+//
+// Requests of up to poolMaxBytes get rounded up to a size class (multiples
+// of poolAlignment) and served from fixed-size blocks. Each thread caches
+// free blocks per size class in a plain singly linked list, so allocating
+// and freeing is a pointer pop/push without any lock. Threads trade blocks
+// with a global pool a batch of poolBatchSize at a time: an empty cache
+// fetches a batch, a cache that grew to twice that returns one (so a
+// thread freeing what another allocated doesn't hoard), and a cache goes
+// back to the global pool entirely when its thread exits. The global pool
+// carves new blocks from big slabs it never gives back, so a long-running
+// cache of nodes ends up on few, densely packed pages instead of being
+// spread across the heap. Bigger requests (like a vector<T, PoolAllocator>
+// growing) go to operator new.
+//
+// PoolAllocator<T> is the C++11 allocator on top, e.g.
+//   map<int, string, less<int>, PoolAllocator<pair<const int, string>>>
+// Any two PoolAllocators compare equal, memory may be freed by any thread.
+// See stl_benchmark_pool() in stl.cpp.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+const size_t poolAlignment = 16; // and the size class granularity
+const size_t poolMaxBytes = 256;
+const size_t poolBatchSize = 32;
+
+void* poolAllocate(size_t bytes);
+void poolDeallocate(void* p, size_t bytes); // bytes as passed to poolAllocate()
+
+// of the global pool, summed over the size classes
+struct PoolStats {
+  uint64_t slabBytes; // carved from the heap so far
+  uint64_t globalFreeBlocks; // not counting what sits in thread caches
+  uint64_t batchFetchN;
+  uint64_t batchReturnN;
+};
+
+PoolStats poolStats();
+
+template <class T>
+class PoolAllocator {
+  static_assert(alignof(T) <= poolAlignment, "PoolAllocator blocks are only 16 byte aligned");
+
+  public:
+    typedef T value_type;
+
+    PoolAllocator() {}
+    template <class U>
+    PoolAllocator(const PoolAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+      return static_cast<T*>(poolAllocate(n * sizeof(T)));
+    }
+    void deallocate(T* p, size_t n) {
+      poolDeallocate(p, n * sizeof(T));
+    }
+};
+
+template <class T, class U>
+bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) {
+  return true;
+}
+template <class T, class U>
+bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) {
+  return false;
+}
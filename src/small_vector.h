@@ -0,0 +1,217 @@
+// Vector with room for N elements inside the object itself, so that short
+// vectors (like the 3-20 ints of A in move.cpp) need no heap allocation.
+// Beyond N it moves everything to the heap, growing by doubling like
+// std::vector.
+//
+// The price: moving a small_vector whose elements are still inline has to
+// move them one by one (std::vector only swaps pointers), and since that
+// may throw, so may the move ctor unless T's is noexcept. Like std::vector
+// iterators are plain pointers and get invalidated by growing, and also
+// by moving from an inline small_vector.
+// See the vector vs small_vector runs in play_with_move().
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <algorithm>
+#include <initializer_list>
+#include <type_traits>
+#include <stdexcept>
+
+template <class T, size_t N>
+class small_vector {
+  static_assert(N > 0, "small_vector needs room for at least 1 element, else use std::vector");
+
+  public:
+    typedef T value_type;
+    typedef size_t size_type;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+
+    small_vector() : begin_(inlineData()), size_(0), capacity_(N) {}
+
+    // these delegate to the default ctor so that the dtor cleans up if
+    // constructing an element throws halfway
+    explicit small_vector(size_t n, const T& value = T()) : small_vector() {
+      reserve(n);
+      while (size_ < n)
+        new (begin_ + size_++) T(value);
+    }
+
+    small_vector(std::initializer_list<T> values) : small_vector() {
+      reserve(values.size());
+      for (const T& value : values)
+        new (begin_ + size_++) T(value);
+    }
+
+    small_vector(const small_vector& rhs) : small_vector() {
+      reserve(rhs.size_);
+      for (const T& value : rhs)
+        new (begin_ + size_++) T(value);
+    }
+
+    small_vector(small_vector&& rhs) noexcept(std::is_nothrow_move_constructible<T>::value) : small_vector() {
+      moveFrom(rhs);
+    }
+
+    ~small_vector() {
+      clear();
+      freeHeap();
+    }
+
+    small_vector& operator=(const small_vector& rhs) {
+      if (this != &rhs) {
+        clear();
+        reserve(rhs.size_);
+        for (const T& value : rhs)
+          new (begin_ + size_++) T(value);
+      }
+      return *this;
+    }
+
+    small_vector& operator=(small_vector&& rhs) noexcept(std::is_nothrow_move_constructible<T>::value) {
+      if (this != &rhs) {
+        clear();
+        freeHeap();
+        moveFrom(rhs);
+      }
+      return *this;
+    }
+
+    size_t size() const { return size_; }
+    size_t capacity() const { return capacity_; }
+    bool empty() const { return size_ == 0; }
+    // whether the elements still live inside the object
+    bool is_inline() const { return begin_ == inlineData(); }
+
+    T* data() { return begin_; }
+    const T* data() const { return begin_; }
+    iterator begin() { return begin_; }
+    iterator end() { return begin_ + size_; }
+    const_iterator begin() const { return begin_; }
+    const_iterator end() const { return begin_ + size_; }
+
+    T& operator[](size_t i) { return begin_[i]; }
+    const T& operator[](size_t i) const { return begin_[i]; }
+    T& at(size_t i) {
+      if (i >= size_)
+        throw std::out_of_range("small_vector::at");
+      return begin_[i];
+    }
+    const T& at(size_t i) const { return const_cast<small_vector*>(this)->at(i); }
+    T& front() { return begin_[0]; }
+    const T& front() const { return begin_[0]; }
+    T& back() { return begin_[size_ - 1]; }
+    const T& back() const { return begin_[size_ - 1]; }
+
+    void push_back(const T& value) { emplace_back(value); }
+    void push_back(T&& value) { emplace_back(std::move(value)); }
+
+    template <class... Args>
+    T& emplace_back(Args&&... args) {
+      if (size_ == capacity_) {
+        // args may refer to one of our elements, so construct before growing
+        T value(std::forward<Args>(args)...);
+        grow(size_ + 1);
+        new (begin_ + size_) T(std::move(value));
+      }
+      else {
+        new (begin_ + size_) T(std::forward<Args>(args)...);
+      }
+      return begin_[size_++];
+    }
+
+    void pop_back() {
+      begin_[--size_].~T();
+    }
+
+    void clear() {
+      while (size_ != 0)
+        pop_back();
+    }
+
+    void reserve(size_t capacity) {
+      if (capacity > capacity_)
+        grow(capacity);
+    }
+
+    void resize(size_t size, T value = T()) { // by value, it might be one of ours
+      while (size_ > size)
+        pop_back();
+      reserve(size);
+      while (size_ < size)
+        new (begin_ + size_++) T(value);
+    }
+
+    void swap(small_vector& rhs) {
+      small_vector tmp(std::move(rhs));
+      rhs = std::move(*this);
+      *this = std::move(tmp);
+    }
+
+  private:
+    T* inlineData() { return reinterpret_cast<T*>(&inline_); }
+    const T* inlineData() const { return reinterpret_cast<const T*>(&inline_); }
+
+    // to the heap, at least doubling
+    void grow(size_t minCapacity) {
+      const size_t capacity = std::max(2 * capacity_, minCapacity);
+      T* elements = static_cast<T*>(::operator new(capacity * sizeof(T)));
+      size_t moved = 0;
+      try {
+        for (; moved < size_; ++moved)
+          new (elements + moved) T(std::move_if_noexcept(begin_[moved]));
+      }
+      catch (...) {
+        while (moved != 0)
+          elements[--moved].~T();
+        ::operator delete(elements);
+        throw;
+      }
+      const size_t size = size_;
+      clear();
+      freeHeap();
+      begin_ = elements;
+      size_ = size;
+      capacity_ = capacity;
+    }
+
+    // back to the inline buffer, which must be empty
+    void freeHeap() {
+      if (!is_inline())
+        ::operator delete(begin_);
+      begin_ = inlineData();
+      capacity_ = N;
+    }
+
+    // we're empty & inline, rhs ends up so too
+    void moveFrom(small_vector& rhs) {
+      if (rhs.is_inline()) {
+        for (T& value : rhs)
+          new (begin_ + size_++) T(std::move(value));
+        rhs.clear();
+      }
+      else {
+        begin_ = rhs.begin_;
+        size_ = rhs.size_;
+        capacity_ = rhs.capacity_;
+        rhs.begin_ = rhs.inlineData();
+        rhs.size_ = 0;
+        rhs.capacity_ = N;
+      }
+    }
+
+    T* begin_;
+    size_t size_;
+    size_t capacity_;
+    typename std::aligned_storage<sizeof(T) * N, alignof(T)>::type inline_;
+};
+
+template <class T, size_t N>
+void swap(small_vector<T, N>& a, small_vector<T, N>& b) {
+  a.swap(b);
+}
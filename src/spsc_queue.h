@@ -0,0 +1,82 @@
+// Bounded wait-free single-producer/single-consumer FIFO ring.
+//
+// Only the producer writes tail_ and only the consumer writes head_, so the
+// hot path is plain loads & stores with acquire/release ordering, no
+// atomic read-modify-write at all. Each side also keeps a cached copy of
+// the other side's index and only re-reads the real one (i.e. pulls the
+// other core's cache line over) when the cached one says full or empty.
+// See benchmarkHandOffLatency() in threading.cpp.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+#include <stdexcept>
+
+#include "cache_aligned.h"
+
+template <class T>
+class SpscQueue {
+  public:
+    // capacity gets rounded up to a power of 2
+    explicit SpscQueue(size_t capacity)
+        : buffer_(roundUpToPowerOf2(capacity)), mask_(buffer_.size() - 1),
+          tail_(0), cachedHead_(0), head_(0), cachedTail_(0) {}
+
+    size_t capacity() const { return buffer_.size(); }
+
+    // producer only, returns false if the queue is full
+    bool tryPush(const T& item) {
+      const size_t tail = tail_.load(std::memory_order_relaxed);
+      if (tail - cachedHead_ == buffer_.size()) {
+        cachedHead_ = head_.load(std::memory_order_acquire);
+        if (tail - cachedHead_ == buffer_.size())
+          return false;
+      }
+      buffer_[tail & mask_] = item;
+      tail_.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    // consumer only
+    bool empty() const {
+      return head_.load(std::memory_order_relaxed) == tail_.load(std::memory_order_acquire);
+    }
+
+    // consumer only, returns false if the queue is empty
+    bool tryPop(T& item) {
+      const size_t head = head_.load(std::memory_order_relaxed);
+      if (head == cachedTail_) {
+        cachedTail_ = tail_.load(std::memory_order_acquire);
+        if (head == cachedTail_)
+          return false;
+      }
+      item = std::move(buffer_[head & mask_]);
+      head_.store(head + 1, std::memory_order_release);
+      return true;
+    }
+
+  private:
+    SpscQueue(const SpscQueue&); // = delete, but vs2012
+    SpscQueue& operator=(const SpscQueue&);
+
+    static size_t roundUpToPowerOf2(size_t n) {
+      if (n < 1)
+        throw std::invalid_argument("SpscQueue capacity must be >= 1");
+      size_t result = 1;
+      while (result < n)
+        result *= 2;
+      return result;
+    }
+
+    std::vector<T> buffer_;
+    const size_t mask_;
+    // producer's line
+    alignas(cacheLineSize) std::atomic<size_t> tail_;
+    size_t cachedHead_;
+    // consumer's line
+    alignas(cacheLineSize) std::atomic<size_t> head_;
+    size_t cachedTail_;
+    char padding_[cacheLineSize - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+};
@@ -11,6 +11,7 @@
 #include <functional> // std::plus
 #include <algorithm> // std::transform
 #include <cassert> // assert
+#include <cstring> // memset
 //#include <initializer_list> // std::initializer_list
 #include <string>
 #include <iomanip>
@@ -19,10 +20,20 @@
 #include <unordered_set>
 #include <list>
 #include <codecvt> // not in gcc 4.9 yet, requires clang libc++
+#include <memory> // std::allocator_traits
+#include <chrono>
+#include <numeric> // std::iota
+#include <random>
+
+#include "arena.h"
+#include "pool_allocator.h"
+#include "alloc_tracker.h"
 
 using namespace std;
 
 void stl_play_with_sort();
+void stl_benchmark_arena();
+void stl_benchmark_pool();
 
 void stl_play_with_custom_type_traits();
 
@@ -610,6 +621,8 @@ void play_with_stl() {
   }
 
   stl_play_with_sort();
+  stl_benchmark_arena();
+  stl_benchmark_pool();
 
   // bit fields: I first thought these were part of C++11, but they were
   // available in C++98 alrdy. This code here has nothing to do with STL,
@@ -888,3 +901,176 @@ void stl_play_with_sort() {
   }
 }
 
+// S from above with its strings on CharAlloc
+template <class CharAlloc>
+struct RequestRecord {
+  typedef basic_string<char, char_traits<char>, CharAlloc> String;
+  String firstName;
+  String lastName;
+};
+
+// What stl_play_with_sort() does, scaled up to a request's worth: a vector
+// of records plus a vector of ptrs to them sorted by lastName, everything
+// allocated via (rebinds of) alloc.
+template <class CharAlloc>
+size_t buildRequestGraph(const vector<string>& firstNames, const vector<string>& lastNames, const CharAlloc& alloc) {
+  typedef RequestRecord<CharAlloc> Record;
+  typedef typename Record::String String;
+  typedef typename allocator_traits<CharAlloc>::template rebind_alloc<Record> RecordAlloc;
+  typedef typename allocator_traits<CharAlloc>::template rebind_alloc<const Record*> PtrAlloc;
+
+  vector<Record, RecordAlloc> records{RecordAlloc(alloc)};
+  for (size_t i=0; i<firstNames.size(); ++i)
+    records.push_back(Record{String(firstNames[i].c_str(), alloc), String(lastNames[i].c_str(), alloc)});
+  vector<const Record*, PtrAlloc> sortedByLast{PtrAlloc(alloc)};
+  for (const Record& record : records)
+    sortedByLast.push_back(&record);
+  std::sort(sortedByLast.begin(), sortedByLast.end(), [](const Record* lhs, const Record* rhs) {
+    return lhs->lastName < rhs->lastName;
+  });
+  return sortedByLast.front()->lastName.size() + sortedByLast.back()->firstName.size();
+}
+
+// Mixed sizes & alignments, including a request bigger than the first
+// chunk followed by one whose alignment overshoots that chunk's end. Each
+// block must be aligned and not overlap any other, before and after reset().
+void stl_check_arena() {
+  const size_t sizes[] = { 5000, 1, 3, 24, 100, 4096, 7, 640, 1 };
+  const size_t alignments[] = { 1, 16, 2, 8, 64, 4, 256, 32, 1 };
+  ArenaResource arena(4096);
+  for (int round=0; round<3; ++round) {
+    vector<pair<char*, size_t>> blocks;
+    for (int i=0; i<50; ++i) {
+      const size_t bytes = sizes[i % 9], alignment = alignments[(i + round) % 9];
+      char* p = static_cast<char*>(arena.allocate(bytes, alignment));
+      assert(reinterpret_cast<uintptr_t>(p) % alignment == 0);
+      memset(p, i, bytes);
+      blocks.push_back(make_pair(p, bytes));
+    }
+    sort(blocks.begin(), blocks.end());
+    for (size_t i=1; i<blocks.size(); ++i)
+      assert(blocks[i - 1].first + blocks[i - 1].second <= blocks[i].first);
+    arena.reset();
+  }
+}
+
+// builds & tears down requestN request graphs with the default allocator
+// vs an arena that gets reset() after each request
+void stl_benchmark_arena() {
+  stl_check_arena();
+  const int recordN = 1000;
+  const int requestN = 200;
+  vector<string> firstNames, lastNames; // longer than any small string buffer
+  for (int i=0; i<recordN; ++i) {
+    firstNames.push_back("first name #" + to_string((i * 7919) % recordN) + " of the request");
+    lastNames.push_back("last name #" + to_string((i * 104729) % recordN) + " of the request");
+  }
+
+  cout << "\n" << requestN << " request graphs of " << recordN << " records\n";
+  cout << setw(24) << "" << setw(14) << "us/request" << setw(16) << "allocs/request" << '\n';
+  auto report = [requestN](const char* name, function<size_t()> request) {
+    TrackingRegion region(name, false);
+    auto t0 = chrono::steady_clock::now();
+    size_t checksum = 0;
+    for (int i=0; i<requestN; ++i)
+      checksum += request();
+    auto us = chrono::duration<double, micro>(chrono::steady_clock::now() - t0).count();
+    cout << setw(24) << name << fixed << setprecision(1) << setw(14) << us / requestN
+         << setw(16) << double(region.stats().allocN) / requestN << '\n';
+    cout.unsetf(ios::floatfield);
+    return checksum;
+  };
+
+  const size_t expected = report("default allocator", [&]() {
+    return buildRequestGraph(firstNames, lastNames, allocator<char>());
+  });
+  ArenaResource arena;
+  size_t checksum = report("arena", [&]() {
+    size_t result = buildRequestGraph(firstNames, lastNames, ArenaAllocator<char>(arena));
+    arena.reset();
+    return result;
+  });
+#ifdef ARENA_HAS_PMR
+  checksum += report("arena via std::pmr", [&]() {
+    size_t result = buildRequestGraph(firstNames, lastNames, pmr::polymorphic_allocator<char>(&arena));
+    arena.reset();
+    return result;
+  });
+  checksum /= 2;
+#endif
+  if (checksum != expected)
+    cout << "stl_benchmark_arena: checksums differ\n";
+}
+
+// A long-running cache: keys[i] gets inserted and the key inserted
+// cacheSize steps earlier erased, so the container stays at cacheSize nodes
+// while they all get replaced over and over.
+template <class Map>
+size_t churnMap(Map& map, const vector<int>& keys, size_t cacheSize) {
+  for (size_t i=0; i<keys.size(); ++i) {
+    map.emplace(keys[i], i);
+    if (i >= cacheSize)
+      map.erase(keys[i - cacheSize]);
+  }
+  return map.size();
+}
+
+template <class Set>
+size_t churnSet(Set& set, const vector<int>& keys, size_t cacheSize) {
+  for (size_t i=0; i<keys.size(); ++i) {
+    set.insert(keys[i]);
+    if (i >= cacheSize)
+      set.erase(keys[i - cacheSize]);
+  }
+  return set.size();
+}
+
+// same for a FIFO, like apples2 in play_with_member_pointers()
+template <class List>
+size_t churnList(List& list, size_t opN, size_t cacheSize) {
+  for (size_t i=0; i<opN; ++i) {
+    list.push_back(i);
+    if (i >= cacheSize)
+      list.pop_front();
+  }
+  return list.size();
+}
+
+// node-based containers with std::allocator vs PoolAllocator
+void stl_benchmark_pool() {
+  const size_t cacheSize = 100000;
+  const size_t opN = 1000000;
+  vector<int> keys(opN);
+  iota(keys.begin(), keys.end(), 0);
+  shuffle(keys.begin(), keys.end(), mt19937(42));
+
+  cout << "\n" << opN << " inserts & erases on containers of " << cacheSize << " nodes\n";
+  cout << setw(36) << "" << setw(12) << "ns/op" << setw(12) << "allocs/op" << '\n';
+  auto report = [opN](const char* name, function<size_t()> churn) {
+    TrackingRegion region(name, false);
+    auto t0 = chrono::steady_clock::now();
+    const size_t size = churn();
+    auto ns = chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count();
+    cout << setw(36) << name << fixed << setprecision(1) << setw(12) << ns / opN
+         << setw(12) << double(region.stats().allocN) / opN << '\n';
+    cout.unsetf(ios::floatfield);
+    return size;
+  };
+
+  // Fresh containers each, but the pool keeps its blocks, so a second pool
+  // run shows the steady state of a cache that has been running for a while.
+  typedef map<int, size_t, less<int>, PoolAllocator<pair<const int, size_t>>> PoolMap;
+  typedef set<int, less<int>, PoolAllocator<int>> PoolSet;
+  typedef list<size_t, PoolAllocator<size_t>> PoolList;
+  report("map, std::allocator", [&]() { map<int, size_t> m; return churnMap(m, keys, cacheSize); });
+  report("map, PoolAllocator", [&]() { PoolMap m; return churnMap(m, keys, cacheSize); });
+  report("map, PoolAllocator (warm)", [&]() { PoolMap m; return churnMap(m, keys, cacheSize); });
+  report("set, std::allocator", [&]() { set<int> s; return churnSet(s, keys, cacheSize); });
+  report("set, PoolAllocator", [&]() { PoolSet s; return churnSet(s, keys, cacheSize); });
+  report("list, std::allocator", [&]() { list<size_t> l; return churnList(l, opN, cacheSize); });
+  report("list, PoolAllocator", [&]() { PoolList l; return churnList(l, opN, cacheSize); });
+
+  const PoolStats stats = poolStats();
+  cout << "pool: " << stats.slabBytes / 1024 << " KiB in slabs, " << stats.batchFetchN << " batch fetches, "
+       << stats.batchReturnN << " batch returns\n";
+}
@@ -0,0 +1,317 @@
+// Fixed-size work-stealing thread pool.
+//
+// Each worker owns a Chase-Lev deque: it pushes & pops tasks at the bottom
+// (LIFO, so recursively forked tasks stay hot in its cache) while idle
+// workers steal from the top of a randomly picked victim (FIFO, i.e. the
+// oldest and typically biggest chunks of work). Tasks submitted from outside
+// the pool go through a plain mutex-protected injection queue. Idle workers
+// park on a condvar, submitters only touch its mutex if one actually is.
+//
+// Blocking on a future from within a task would tie up the worker, and with
+// enough nesting deadlock the pool, so fork-join code waits via join(),
+// which keeps running other tasks until the future is ready.
+// See benchmarkWorkStealing() in threading.cpp.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+
+#include "cache_aligned.h"
+
+// The deque of "Dynamic Circular Work-Stealing Deque" (Chase & Lev 2005),
+// with the C11 memory orders of "Correct and Efficient Work-Stealing for
+// Weak Memory Models" (Le et al. 2013). Holds pointers, nullptr means empty.
+template <class T>
+class ChaseLevDeque {
+  public:
+    explicit ChaseLevDeque(size_t capacity = 256) : top_(0), bottom_(0) {
+      size_t size = 1;
+      while (size < capacity)
+        size *= 2;
+      arrays_.push_back(new Array(size));
+      array_.store(arrays_.back(), std::memory_order_relaxed);
+    }
+
+    ~ChaseLevDeque() {
+      for (Array* array : arrays_)
+        delete array;
+    }
+
+    // owner only
+    void push(T* item) {
+      int64_t b = bottom_.load(std::memory_order_relaxed);
+      int64_t t = top_.load(std::memory_order_acquire);
+      Array* array = array_.load(std::memory_order_relaxed);
+      if (b - t > static_cast<int64_t>(array->mask))
+        array = grow(array, t, b);
+      array->put(b, item);
+      bottom_.store(b + 1, std::memory_order_release); // publishes item (and *item) to steal()
+    }
+
+    // owner only, returns the most recently pushed item or nullptr
+    T* pop() {
+      int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+      Array* array = array_.load(std::memory_order_relaxed);
+      bottom_.store(b, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      int64_t t = top_.load(std::memory_order_relaxed);
+      if (t > b) { // was empty
+        bottom_.store(b + 1, std::memory_order_relaxed);
+        return nullptr;
+      }
+      T* item = array->get(b);
+      if (t == b) { // the last item, thieves might be after it too
+        if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+          item = nullptr;
+        bottom_.store(b + 1, std::memory_order_relaxed);
+      }
+      return item;
+    }
+
+    // any thread, returns the oldest item, or nullptr if empty or another
+    // thief (or the owner) won the race for it
+    T* steal() {
+      int64_t t = top_.load(std::memory_order_acquire);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      int64_t b = bottom_.load(std::memory_order_acquire);
+      if (t >= b)
+        return nullptr;
+      Array* array = array_.load(std::memory_order_acquire);
+      T* item = array->get(t);
+      if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        return nullptr;
+      return item;
+    }
+
+    // racy, good enough for deciding whether to go to sleep
+    bool empty() const {
+      return bottom_.load(std::memory_order_relaxed) <= top_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    ChaseLevDeque(const ChaseLevDeque&); // = delete, but vs2012
+    ChaseLevDeque& operator=(const ChaseLevDeque&);
+
+    struct Array {
+      explicit Array(size_t size) : mask(size - 1), items(new std::atomic<T*>[size]) {}
+      T* get(int64_t i) const { return items[i & mask].load(std::memory_order_relaxed); }
+      void put(int64_t i, T* item) { items[i & mask].store(item, std::memory_order_relaxed); }
+
+      const size_t mask;
+      std::unique_ptr<std::atomic<T*>[]> items;
+    };
+
+    // Old arrays stay around until the deque dies since a thief may still
+    // be reading from one. They're only half the size of the next, so that
+    // wastes at most as much again.
+    Array* grow(Array* array, int64_t t, int64_t b) {
+      Array* bigger = new Array(2 * (array->mask + 1));
+      for (int64_t i=t; i<b; ++i)
+        bigger->put(i, array->get(i));
+      arrays_.push_back(bigger);
+      array_.store(bigger, std::memory_order_release);
+      return bigger;
+    }
+
+    alignas(cacheLineSize) std::atomic<int64_t> top_; // thieves' end
+    alignas(cacheLineSize) std::atomic<int64_t> bottom_; // owner's end
+    std::atomic<Array*> array_;
+    std::vector<Array*> arrays_; // all ever allocated, owner only
+};
+
+class ThreadPool {
+  public:
+    explicit ThreadPool(size_t threadN = std::max(1u, std::thread::hardware_concurrency()))
+        : sleeperN_(0), stop_(false) {
+      // all deques need to exist before the first worker goes stealing
+      for (size_t i=0; i<threadN; ++i)
+        workers_.push_back(std::unique_ptr<Worker>(new Worker));
+      for (size_t i=0; i<threadN; ++i)
+        workers_[i]->thread = std::thread([this, i]() { workerLoop(i); });
+    }
+
+    // runs all pending tasks, then joins the workers
+    ~ThreadPool() {
+      {
+        std::lock_guard<std::mutex> lock(sleepMutex_);
+        stop_ = true;
+      }
+      sleepCondition_.notify_all();
+      for (auto& worker : workers_)
+        worker->thread.join();
+    }
+
+    size_t size() const { return workers_.size(); }
+
+    // Runs f() on some pool thread. Called from a pool thread the task goes
+    // onto that thread's own deque, otherwise into the injection queue.
+    template <class F>
+    auto submit(F f) -> std::future<decltype(f())> {
+      typedef decltype(f()) R;
+      std::unique_ptr<TaskImpl<R>> task(new TaskImpl<R>(std::packaged_task<R()>(std::move(f))));
+      std::future<R> future = task->task.get_future();
+      schedule(std::move(task));
+      return future;
+    }
+
+    // Like submit() minus the future, for fire & forget work such as the
+    // continuations in future.h. f must not throw.
+    template <class F>
+    void post(F f) {
+      schedule(std::unique_ptr<Task>(new FuncTask<F>(std::move(f))));
+    }
+
+    // future.get(), except that the calling thread keeps running pending
+    // tasks until the future is ready instead of blocking
+    template <class R>
+    R join(std::future<R>& future) {
+      while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        if (!runPendingTask())
+          std::this_thread::yield();
+      return future.get();
+    }
+
+    // Runs one pending task, if there is one: from the caller's own deque,
+    // the injection queue or else stolen from another worker.
+    bool runPendingTask() {
+      ThreadInfo& self = currentThread();
+      std::unique_ptr<Task> task;
+      if (self.pool == this)
+        task.reset(workers_[self.index]->deque.pop());
+      if (!task)
+        task = popInjected();
+      if (!task)
+        task.reset(steal(self));
+      if (!task)
+        return false;
+      task->run();
+      return true;
+    }
+
+  private:
+    ThreadPool(const ThreadPool&); // = delete, but vs2012
+    ThreadPool& operator=(const ThreadPool&);
+
+    // type-erased packaged_task, which unlike std::function may be move-only
+    struct Task {
+      virtual ~Task() {}
+      virtual void run() = 0;
+    };
+    template <class R>
+    struct TaskImpl : Task {
+      explicit TaskImpl(std::packaged_task<R()>&& task) : task(std::move(task)) {}
+      void run() { task(); }
+      std::packaged_task<R()> task;
+    };
+    template <class F>
+    struct FuncTask : Task {
+      explicit FuncTask(F&& f) : f(std::move(f)) {}
+      void run() { f(); }
+      F f;
+    };
+
+    // heap allocated, so CacheAligned for the deque's alignas(cacheLineSize) indices
+    struct Worker : CacheAligned {
+      ChaseLevDeque<Task> deque;
+      std::thread thread;
+    };
+
+    // which pool & worker the calling thread is, if any
+    struct ThreadInfo {
+      ThreadPool* pool;
+      size_t index;
+      uint32_t random; // xorshift state for picking victims
+    };
+    static ThreadInfo& currentThread() {
+      static thread_local ThreadInfo info = { nullptr, 0, 0 };
+      return info;
+    }
+
+    void schedule(std::unique_ptr<Task> task) {
+      const ThreadInfo& self = currentThread();
+      if (self.pool == this) {
+        workers_[self.index]->deque.push(task.release());
+      }
+      else {
+        std::lock_guard<std::mutex> lock(injectionMutex_);
+        injected_.push_back(task.get());
+        task.release();
+      }
+      // pairs with the fence in workerLoop(): either we see the sleeper or it sees the task
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (sleeperN_.load(std::memory_order_relaxed) != 0) {
+        std::lock_guard<std::mutex> lock(sleepMutex_);
+        sleepCondition_.notify_one();
+      }
+    }
+
+    std::unique_ptr<Task> popInjected() {
+      std::lock_guard<std::mutex> lock(injectionMutex_);
+      if (injected_.empty())
+        return std::unique_ptr<Task>();
+      std::unique_ptr<Task> task(injected_.front());
+      injected_.pop_front();
+      return task;
+    }
+
+    // tries each other worker once, starting at a random one
+    Task* steal(ThreadInfo& self) {
+      if (self.random == 0)
+        self.random = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(&self)) | 1;
+      self.random ^= self.random << 13;
+      self.random ^= self.random >> 17;
+      self.random ^= self.random << 5;
+      const size_t n = workers_.size();
+      for (size_t i=0, victim=self.random % n; i<n; ++i, victim = (victim + 1) % n) {
+        if (self.pool == this && victim == self.index)
+          continue;
+        if (Task* task = workers_[victim]->deque.steal())
+          return task;
+      }
+      return nullptr;
+    }
+
+    // racy like ChaseLevDeque::empty()
+    bool hasPendingTask() {
+      for (auto& worker : workers_)
+        if (!worker->deque.empty())
+          return true;
+      std::lock_guard<std::mutex> lock(injectionMutex_);
+      return !injected_.empty();
+    }
+
+    void workerLoop(size_t index) {
+      ThreadInfo& self = currentThread();
+      self.pool = this;
+      self.index = index;
+      for (;;) {
+        if (runPendingTask())
+          continue;
+        std::unique_lock<std::mutex> lock(sleepMutex_);
+        sleeperN_.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        sleepCondition_.wait(lock, [this]() { return stop_ || hasPendingTask(); });
+        sleeperN_.fetch_sub(1, std::memory_order_relaxed);
+        if (stop_ && !hasPendingTask())
+          return;
+      }
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::mutex injectionMutex_;
+    std::deque<Task*> injected_;
+    std::atomic<int> sleeperN_;
+    bool stop_; // guarded by sleepMutex_
+    std::mutex sleepMutex_;
+    std::condition_variable sleepCondition_;
+};
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <vector>
+#include <deque>
 #include <iterator> // std::back_inserter
 #include <functional> // std::plus
 #include <algorithm> // std::transform
@@ -7,50 +8,720 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <iomanip>
+#include <stdexcept>
+#include <numeric> // std::accumulate
+#include <future>
+#include <random>
+#include <cmath>
 
+#include "mpmc_queue.h"
+#include "spsc_queue.h"
+#include "thread_pool.h"
+#include "future.h"
+#include "adaptive_mutex.h"
+#include "async_logger.h"
+#include "parallel.h"
 
 using namespace std;
 
-recursive_mutex cout_mutex; // global mutexes are horrible of course, is test code only
+#define CONFIG_LOCK_STATS // comment out this line to neither collect nor dump (at exit) lock stats
+
+// named mutexes collect stats, see adaptive_mutex.h
+static const char* lockName(const char* name) {
+#ifdef CONFIG_LOCK_STATS
+  return name;
+#else
+  (void)name;
+  return nullptr;
+#endif
+}
+
+AsyncLogger logger(cout, LogOverflow::Block); // globals are horrible of course, is test code only
 
 void threadFunc(int x) {
   int scaleFactor = 100;
   auto sleepTimeInMs = max(0, (5 - x)*scaleFactor);
   //std::this_thread::sleep_for(std::chrono::milliseconds(sleepTimeInMs));
-  lock_guard<recursive_mutex> lock(cout_mutex);
-  cout << "thread " << std::this_thread::get_id() << " slept=" << sleepTimeInMs << " ms value=" << x << endl;
+  logger.log("thread slept={} ms value={}", sleepTimeInMs, x);
 }
 
+// what ProducerConsumer does when a producer finds the queue at capacity
+enum class QueueOverflow {
+  Block, // until a consumer makes room
+  DropOldest, // the item that has been waiting longest makes room
+  DropNewest, // the item being pushed gets dropped
+  Fail // throws overflow_error
+};
+
 class ProducerConsumer {
   public:
+    // capacity 0 means unbounded
+    explicit ProducerConsumer(size_t capacity = 0, QueueOverflow overflow = QueueOverflow::Block)
+        : capacity(capacity), overflow(overflow), blockedProducerN(0) {}
+
+    struct Metrics {
+      Metrics() : depth(0), highWaterMark(0), droppedN(0), stallN(0), stallTime(0) {}
+      size_t depth; // items queued right now
+      size_t highWaterMark; // most items ever queued
+      size_t droppedN; // by DropOldest or DropNewest
+      size_t stallN; // pushes that blocked
+      chrono::nanoseconds stallTime; // all producers' blocked time summed up
+    };
+    Metrics metrics() {
+      std::lock_guard<AdaptiveMutex> lock(mutex);
+      Metrics result = stats;
+      result.depth = workItemQueue.size();
+      return result;
+    }
+
     void produce(int count) {
       for (int i=0; i<count; ++i) {
         std::this_thread::sleep_for(chrono::milliseconds(500));
-        std::lock_guard<std::mutex> lock(mutex);
-        cout << "producer thread " << std::this_thread::get_id() << " produced item=" << i << endl;
-        workItemQueue.push_back(i);
-        conditionVariable.notify_one();
+        std::unique_lock<AdaptiveMutex> lock(mutex);
+        logger.log("producer thread produced item={}", i);
+        if (pushLocked(lock, i))
+          notEmpty.notify_one();
       }
     }
     void consume(int count) {
       for (int i=0; i<count; ++i)
       {
-        std::unique_lock<std::mutex> lock(mutex);
-        conditionVariable.wait(lock, [&]{return !workItemQueue.empty();});
-        int workItem = workItemQueue.back();
-        workItemQueue.pop_back();
+        std::unique_lock<AdaptiveMutex> lock(mutex);
+        notEmpty.wait(lock, [&]{return !workItemQueue.empty();});
+        int workItem = workItemQueue.front();
+        workItemQueue.pop_front();
+        if (blockedProducerN != 0)
+          notFull.notify_one();
         // processing the item while holding the lock would be silly, whatever, it's just a test
-        cout << "consumer thread " << std::this_thread::get_id() << " consumed item=" << workItem << endl;
+        logger.log("consumer thread consumed item={}", workItem);
+      }
+      logger.log("consumer thread exits");
+    }
+
+    // same as produce/consume minus the sleeping & logging, for
+    // benchmarkQueues(). Returns false if the item got dropped (DropNewest).
+    bool push(int item) {
+      std::unique_lock<AdaptiveMutex> lock(mutex);
+      const bool queued = pushLocked(lock, item);
+      if (queued)
+        notEmpty.notify_one();
+      return queued;
+    }
+    int pop() {
+      std::unique_lock<AdaptiveMutex> lock(mutex);
+      notEmpty.wait(lock, [&]{return !workItemQueue.empty();});
+      int workItem = workItemQueue.front();
+      workItemQueue.pop_front();
+      if (blockedProducerN != 0)
+        notFull.notify_one();
+      return workItem;
+    }
+
+    // Batched push & pop: one lock round-trip for many items. Consumers only
+    // get woken when the queue goes from empty to non-empty, since otherwise
+    // nobody is waiting. Then all of them, since a batch may feed several.
+    // The overflow policy applies item by item, i.e. with Fail the items
+    // before the one that didn't fit stay queued.
+    template <class Iter>
+    void produce_batch(Iter begin, Iter end) {
+      if (begin == end)
+        return;
+      std::unique_lock<AdaptiveMutex> lock(mutex);
+      bool becameNonEmpty = false;
+      for (Iter it = begin; it != end; ++it) {
+        const bool wasEmpty = workItemQueue.empty();
+        if (pushLocked(lock, *it) && wasEmpty)
+          becameNonEmpty = true;
       }
-      cout << "consumer thread exits\n";
+      if (becameNonEmpty)
+        notEmpty.notify_all();
+    }
+    // waits for at least 1 item, returns up to maxN, oldest first like pop()
+    vector<int> consume_batch(size_t maxN) {
+      std::unique_lock<AdaptiveMutex> lock(mutex);
+      notEmpty.wait(lock, [&]{return !workItemQueue.empty();});
+      const size_t n = min(maxN, workItemQueue.size());
+      vector<int> workItems(workItemQueue.begin(), workItemQueue.begin() + n);
+      workItemQueue.erase(workItemQueue.begin(), workItemQueue.begin() + n);
+      if (blockedProducerN != 0)
+        notFull.notify_all();
+      return workItems;
     }
   private:
-    vector<int> workItemQueue;
+    // queues item unless the overflow policy says otherwise, returns whether it did
+    bool pushLocked(std::unique_lock<AdaptiveMutex>& lock, int item) {
+      if (capacity != 0 && workItemQueue.size() >= capacity) {
+        switch (overflow) {
+          case QueueOverflow::Block: {
+            // consumers may still be asleep if this batch filled the queue
+            notEmpty.notify_all();
+            auto t0 = chrono::steady_clock::now();
+            ++blockedProducerN;
+            notFull.wait(lock, [&]{return workItemQueue.size() < capacity;});
+            --blockedProducerN;
+            ++stats.stallN;
+            stats.stallTime += chrono::steady_clock::now() - t0;
+            break;
+          }
+          case QueueOverflow::DropOldest:
+            workItemQueue.pop_front();
+            ++stats.droppedN;
+            break;
+          case QueueOverflow::DropNewest:
+            ++stats.droppedN;
+            return false;
+          case QueueOverflow::Fail:
+            throw overflow_error("ProducerConsumer: queue is full");
+        }
+      }
+      workItemQueue.push_back(item);
+      stats.highWaterMark = max(stats.highWaterMark, workItemQueue.size());
+      return true;
+    }
+
+    deque<int> workItemQueue; // FIFO, DropOldest drops the front
+    const size_t capacity;
+    const QueueOverflow overflow;
+    int blockedProducerN;
+    Metrics stats;
+
+    AdaptiveMutex mutex{lockName("ProducerConsumer::mutex")};
+    // std::condition_variable only takes std::mutex
+    std::condition_variable_any notEmpty;
+    std::condition_variable_any notFull;
+};
+
+// Hands itemN ints from threadN/2 producers to as many consumers (or push &
+// pop alternating for threadN=1) through queue, which needs push(int) and
+// int pop(). Returns million items per second.
+template <class Queue>
+double measureQueueThroughput(Queue& queue, int threadN, int itemN) {
+  const int producerN = max(1, threadN / 2);
+  const int consumerN = max(1, threadN - producerN);
+  atomic<long long> checksum(0);
+  auto t0 = chrono::steady_clock::now();
+  if (threadN == 1) {
+    for (int i=0; i<itemN; ++i) {
+      queue.push(i);
+      checksum += queue.pop();
+    }
+  }
+  else {
+    vector<thread> threads;
+    for (int p=0; p<producerN; ++p) {
+      threads.push_back(thread([&queue, p, producerN, itemN]() {
+        for (int i=p; i<itemN; i+=producerN)
+          queue.push(i);
+      }));
+    }
+    for (int c=0; c<consumerN; ++c) {
+      threads.push_back(thread([&queue, &checksum, c, consumerN, itemN]() {
+        long long sum = 0;
+        for (int i=c; i<itemN; i+=consumerN)
+          sum += queue.pop();
+        checksum += sum;
+      }));
+    }
+    for (auto& t : threads)
+      t.join();
+  }
+  auto seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+  if (checksum != static_cast<long long>(itemN) * (itemN - 1) / 2)
+    throw runtime_error("measureQueueThroughput: items got lost or duplicated");
+  return itemN / seconds / 1e6;
+}
 
-    std::mutex mutex;
-    std::condition_variable conditionVariable;
+// swallows everything, so that benchmarkLogging() measures the logging
+// rather than the terminal
+class NullBuffer : public streambuf {
+  protected:
+    int overflow(int c) { return c; }
+    streamsize xsputn(const char*, streamsize n) { return n; }
 };
 
+// threadN threads logging lineN lines in total, returns ns per line as seen
+// by the logging threads
+template <class Log>
+double measureLogging(Log log, int threadN, int lineN) {
+  auto t0 = chrono::steady_clock::now();
+  vector<thread> threads;
+  for (int t=0; t<threadN; ++t) {
+    threads.push_back(thread([&log, threadN, lineN]() {
+      for (int i=0; i<lineN / threadN; ++i)
+        log(i);
+    }));
+  }
+  for (auto& t : threads)
+    t.join();
+  return chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count() / lineN;
+}
+
+// a mutex + endl per line (what cout_mutex used to do) vs AsyncLogger with
+// either overflow policy
+void benchmarkLogging() {
+  const int lineN = 1 << 17;
+  NullBuffer nullBuffer;
+  ostream null(&nullBuffer);
+  cout << "\nlogging to a null stream in ns per line\n";
+  cout << setw(8) << "threads" << setw(16) << "mutex+endl" << setw(16) << "async drop" << setw(16) << "async block" << '\n';
+  for (int threadN = 1; threadN <= 8; threadN *= 2) {
+    std::mutex nullMutex;
+    double mutexNs = measureLogging([&](int i) {
+      lock_guard<std::mutex> lock(nullMutex);
+      null << "thread " << this_thread::get_id() << " item=" << i << endl;
+    }, threadN, lineN);
+    AsyncLogger dropLogger(null, LogOverflow::Drop);
+    double dropNs = measureLogging([&](int i) { dropLogger.log("item={}", i); }, threadN, lineN);
+    AsyncLogger blockLogger(null, LogOverflow::Block);
+    double blockNs = measureLogging([&](int i) { blockLogger.log("item={}", i); }, threadN, lineN);
+    cout << setw(8) << threadN << fixed << setprecision(1) << setw(16) << mutexNs << setw(16) << dropNs << setw(16) << blockNs << '\n';
+    cout.unsetf(ios::floatfield);
+  }
+}
+
+// ProducerConsumer's single mutex vs the lock-free MpmcQueue, 1 to 64 threads
+void benchmarkQueues() {
+  const int itemN = 1 << 18;
+  cout << "\nqueue throughput in Mitems/s, half the threads produce, half consume\n";
+  cout << setw(8) << "threads" << setw(16) << "mutex+condvar" << setw(16) << "lock-free" << '\n';
+  for (int threadN = 1; threadN <= 64; threadN *= 2) {
+    ProducerConsumer producerConsumer;
+    BlockingMpmcQueue<int> mpmcQueue(1024);
+    double mutexRate = measureQueueThroughput(producerConsumer, threadN, itemN);
+    double lockFreeRate = measureQueueThroughput(mpmcQueue, threadN, itemN);
+    cout << setw(8) << threadN << fixed << setprecision(2) << setw(16) << mutexRate << setw(16) << lockFreeRate << '\n';
+    cout.unsetf(ios::floatfield);
+  }
+}
+
+// threadN threads bumping a shared counter under mutex, returns million
+// lock/unlock pairs per second
+template <class Mutex>
+double measureLockThroughput(Mutex& mutex, int threadN, int lockN) {
+  long long counter = 0;
+  auto t0 = chrono::steady_clock::now();
+  vector<thread> threads;
+  for (int t=0; t<threadN; ++t) {
+    threads.push_back(thread([&mutex, &counter, threadN, lockN]() {
+      for (int i=0; i<lockN / threadN; ++i) {
+        lock_guard<Mutex> lock(mutex);
+        ++counter;
+      }
+    }));
+  }
+  for (auto& t : threads)
+    t.join();
+  auto seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+  if (counter != static_cast<long long>(lockN / threadN) * threadN)
+    throw runtime_error("measureLockThroughput: lost increments");
+  return counter / seconds / 1e6;
+}
+
+// std::mutex vs AdaptiveMutex on a tiny critical section. The latter
+// unnamed, i.e. without the stats overhead.
+void benchmarkMutexes() {
+  const int lockN = 1 << 20;
+  cout << "\nmutex throughput in Mlocks/s, tiny critical section\n";
+  cout << setw(8) << "threads" << setw(16) << "std::mutex" << setw(16) << "adaptive" << '\n';
+  for (int threadN = 1; threadN <= 16; threadN *= 2) {
+    std::mutex stdMutex;
+    AdaptiveMutex adaptiveMutex;
+    double stdRate = measureLockThroughput(stdMutex, threadN, lockN);
+    double adaptiveRate = measureLockThroughput(adaptiveMutex, threadN, lockN);
+    cout << setw(8) << threadN << fixed << setprecision(2) << setw(16) << stdRate << setw(16) << adaptiveRate << '\n';
+    cout.unsetf(ios::floatfield);
+  }
+}
+
+// spin on a non-blocking queue, yielding so that a single cpu box still gets anywhere
+template <class Queue>
+int spinPop(Queue& queue) {
+  int item;
+  while (!queue.tryPop(item))
+    this_thread::yield();
+  return item;
+}
+
+// Ping-pongs an item between 2 threads through a pair of queues and
+// returns the one-way hand-off latencies in ns (half of each round trip).
+template <class Queue, class Push, class Pop>
+vector<double> measureHandOffs(Queue& ping, Queue& pong, Push push, Pop pop, int roundTripN) {
+  thread echo([&]() {
+    for (int i=0; i<roundTripN; ++i)
+      push(pong, pop(ping));
+  });
+  vector<double> latencies;
+  latencies.reserve(roundTripN);
+  for (int i=0; i<roundTripN; ++i) {
+    auto t0 = chrono::steady_clock::now();
+    push(ping, i);
+    if (pop(pong) != i)
+      throw runtime_error("measureHandOffs: items got mixed up");
+    latencies.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count() / 2);
+  }
+  echo.join();
+  sort(latencies.begin(), latencies.end());
+  return latencies;
+}
+
+// ProducerConsumer's mutex+condvar vs the SPSC ring for a single producer &
+// consumer pair.
+void benchmarkHandOffLatency() {
+  const int roundTripN = 20000;
+  auto percentile = [](const vector<double>& sorted, double p) {
+    return sorted[min(sorted.size() - 1, static_cast<size_t>(p / 100 * sorted.size()))];
+  };
+  auto report = [&](const char* name, const vector<double>& latencies) {
+    cout << setw(24) << name << fixed << setprecision(0) << setw(10) << percentile(latencies, 50)
+         << setw(10) << percentile(latencies, 99) << '\n';
+    cout.unsetf(ios::floatfield);
+  };
+
+  cout << "\nhand-off latency in ns between 2 threads\n";
+  cout << setw(24) << "" << setw(10) << "p50" << setw(10) << "p99" << '\n';
+  {
+    ProducerConsumer ping, pong;
+    report("mutex+condvar", measureHandOffs(ping, pong,
+      [](ProducerConsumer& q, int item) { q.push(item); },
+      [](ProducerConsumer& q) { return q.pop(); }, roundTripN));
+  }
+  {
+    SpscQueue<int> ping(64), pong(64);
+    report("spsc ring", measureHandOffs(ping, pong,
+      [](SpscQueue<int>& q, int item) { while (!q.tryPush(item)) this_thread::yield(); },
+      [](SpscQueue<int>& q) { return spinPop(q); }, roundTripN));
+  }
+}
+
+// Hands itemN ints from producerN to as many consumers through a
+// ProducerConsumer, batchSize items per call, or per-item push/pop for
+// batchSize=1. Returns million items per second.
+double measureBatchThroughput(int producerN, int batchSize, int itemN) {
+  ProducerConsumer queue;
+  atomic<long long> checksum(0);
+  auto t0 = chrono::steady_clock::now();
+  vector<thread> threads;
+  for (int p=0; p<producerN; ++p) {
+    threads.push_back(thread([&queue, p, producerN, batchSize, itemN]() {
+      vector<int> batch;
+      for (int i=p; i<itemN; i+=producerN) {
+        if (batchSize == 1) {
+          queue.push(i);
+          continue;
+        }
+        batch.push_back(i);
+        if (static_cast<int>(batch.size()) == batchSize || i + producerN >= itemN) {
+          queue.produce_batch(batch.begin(), batch.end());
+          batch.clear();
+        }
+      }
+    }));
+  }
+  for (int c=0; c<producerN; ++c) {
+    // each consumer takes a fixed share, so that nobody waits for items that went elsewhere
+    int share = itemN / producerN + (c < itemN % producerN ? 1 : 0);
+    threads.push_back(thread([&queue, &checksum, share, batchSize]() {
+      long long sum = 0;
+      for (int consumed = 0; consumed < share; ) {
+        if (batchSize == 1) {
+          sum += queue.pop();
+          ++consumed;
+          continue;
+        }
+        for (int item : queue.consume_batch(min(batchSize, share - consumed))) {
+          sum += item;
+          ++consumed;
+        }
+      }
+      checksum += sum;
+    }));
+  }
+  for (auto& t : threads)
+    t.join();
+  auto seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+  if (checksum != static_cast<long long>(itemN) * (itemN - 1) / 2)
+    throw runtime_error("measureBatchThroughput: items got lost or duplicated");
+  return itemN / seconds / 1e6;
+}
+
+// per-item push/pop vs produce_batch/consume_batch
+void benchmarkBatching() {
+  const int itemN = 1 << 20;
+  const int batchSizes[] = { 1, 16, 256 };
+  cout << "\nProducerConsumer throughput in Mitems/s by batch size\n";
+  cout << setw(20) << "producers/consumers";
+  for (int batchSize : batchSizes)
+    cout << setw(10) << batchSize;
+  cout << '\n';
+  for (int producerN : { 1, 4 }) {
+    cout << setw(20) << (to_string(producerN) + "/" + to_string(producerN));
+    for (int batchSize : batchSizes)
+      cout << fixed << setprecision(2) << setw(10) << measureBatchThroughput(producerN, batchSize, itemN);
+    cout.unsetf(ios::floatfield);
+    cout << '\n';
+  }
+}
+
+// 4 producers flooding a single consumer that does a bit of work per item,
+// i.e. a saturated ProducerConsumer, unbounded vs bounded with each policy
+void benchmarkBackpressure() {
+  const int producerN = 4;
+  const int itemN = 1 << 18;
+  const size_t capacity = 1024;
+  cout << "\nsaturated ProducerConsumer, " << producerN << " producers, 1 slow consumer, capacity " << capacity << '\n';
+  cout << setw(12) << "policy" << setw(14) << "producers ms" << setw(12) << "high water" << setw(10) << "dropped"
+       << setw(10) << "failed" << setw(10) << "stalls" << setw(10) << "stall ms" << '\n';
+  struct Policy { const char* name; size_t capacity; QueueOverflow overflow; };
+  const Policy policies[] = {
+    { "unbounded", 0, QueueOverflow::Block },
+    { "block", capacity, QueueOverflow::Block },
+    { "drop oldest", capacity, QueueOverflow::DropOldest },
+    { "drop newest", capacity, QueueOverflow::DropNewest },
+    { "fail", capacity, QueueOverflow::Fail },
+  };
+  for (const Policy& policy : policies) {
+    ProducerConsumer queue(policy.capacity, policy.overflow);
+    atomic<int> failedN(0);
+    // push that retries on Fail's exception, returns whether the item got queued
+    auto push = [&queue, &failedN](int item) {
+      for (;;) {
+        try {
+          return queue.push(item);
+        }
+        catch (const overflow_error&) {
+          ++failedN;
+          this_thread::yield();
+        }
+      }
+    };
+    double work = 0;
+    int consumedN = 0;
+    thread consumer([&queue, &work, &consumedN]() {
+      for (int item; (item = queue.pop()) >= 0; ++consumedN)
+        for (int k=0; k<50; ++k)
+          work += sqrt(static_cast<double>(item + k));
+    });
+    auto t0 = chrono::steady_clock::now();
+    vector<thread> producers;
+    for (int p=0; p<producerN; ++p) {
+      producers.push_back(thread([&push, p]() {
+        for (int i=p; i<itemN; i+=producerN)
+          push(i);
+      }));
+    }
+    for (auto& t : producers)
+      t.join();
+    auto producersMs = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    // stops the consumer once it got through everything queued before it,
+    // retried since DropNewest may drop it
+    while (!push(-1))
+      this_thread::yield();
+    consumer.join();
+    ProducerConsumer::Metrics metrics = queue.metrics();
+    cout << setw(12) << policy.name << fixed << setprecision(1) << setw(14) << producersMs
+         << setw(12) << metrics.highWaterMark << setw(10) << metrics.droppedN << setw(10) << failedN
+         << setw(10) << metrics.stallN << setw(10) << chrono::duration<double, milli>(metrics.stallTime).count() << '\n';
+    cout.unsetf(ios::floatfield);
+    if (consumedN + int(metrics.droppedN) != itemN)
+      cout << "  lost " << itemN - consumedN - int(metrics.droppedN) << " items!\n";
+  }
+}
+
+long long fibSerial(int n) {
+  return n < 2 ? n : fibSerial(n - 1) + fibSerial(n - 2);
+}
+
+// fork-join fib: fib(n-1) as a pool task, fib(n-2) right here
+long long fibPool(ThreadPool& pool, int n, int cutoff) {
+  if (n < cutoff)
+    return fibSerial(n);
+  auto left = pool.submit([&pool, n, cutoff]() { return fibPool(pool, n - 1, cutoff); });
+  long long right = fibPool(pool, n - 2, cutoff);
+  return pool.join(left) + right;
+}
+
+// same with a new thread per fork
+long long fibThreads(int n, int cutoff) {
+  if (n < cutoff)
+    return fibSerial(n);
+  long long left = 0;
+  thread t([&left, n, cutoff]() { left = fibThreads(n - 1, cutoff); });
+  long long right = fibThreads(n - 2, cutoff);
+  t.join();
+  return left + right;
+}
+
+// Recursive fib(n) with forks down to the cutoff, the smaller the cutoff
+// the finer grained (and the more numerous) the tasks.
+void benchmarkWorkStealing() {
+  const int n = 30;
+  auto timeMs = [](function<long long()> f, long long expected) {
+    auto t0 = chrono::steady_clock::now();
+    if (f() != expected)
+      throw runtime_error("benchmarkWorkStealing: wrong result");
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+  };
+  ThreadPool pool;
+  const long long expected = fibSerial(n);
+  cout << "\nfork-join fib(" << n << ") in ms, pool of " << pool.size() << " threads\n";
+  cout << setw(8) << "cutoff" << setw(8) << "forks" << setw(10) << "serial" << setw(10) << "threads" << setw(10) << "pool" << '\n';
+  for (int cutoff : { 20, 15, 10 }) {
+    // forks(n) = 0 below the cutoff, else 1 + forks(n-1) + forks(n-2)
+    vector<long long> forks(n + 1, 0);
+    for (int i=cutoff; i<=n; ++i)
+      forks[i] = 1 + forks[i - 1] + forks[i - 2];
+    cout << setw(8) << cutoff << setw(8) << forks[n] << fixed << setprecision(1)
+         << setw(10) << timeMs([&]() { return fibSerial(n); }, expected)
+         << setw(10) << timeMs([&]() { return fibThreads(n, cutoff); }, expected)
+         << setw(10) << timeMs([&]() { return fibPool(pool, n, cutoff); }, expected) << '\n';
+    cout.unsetf(ios::floatfield);
+  }
+}
+
+// runs f on pool, future.h style. post() tasks must not throw, so what f
+// throws goes into the future, like submit() does via packaged_task.
+template <class F>
+Future<int> asyncOn(ThreadPool& pool, F f) {
+  Promise<int> promise;
+  Future<int> future = promise.get_future();
+  pool.post([promise, f]() mutable {
+    try {
+      promise.set_value(f());
+    }
+    catch (...) {
+      promise.set_exception(current_exception());
+    }
+  });
+  return future;
+}
+
+// A chain of dependent +1 stages: std::async + get() per stage, i.e. a
+// thread per stage with the caller blocked meanwhile, vs then() continuations
+// running inline or as pool tasks.
+void benchmarkContinuations() {
+  const int stageN = 10000;
+  auto nsPerStage = [stageN](function<int()> chain) {
+    auto t0 = chrono::steady_clock::now();
+    if (chain() != stageN)
+      throw runtime_error("benchmarkContinuations: wrong result");
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count() / stageN;
+  };
+  ThreadPool pool;
+
+  cout << "\nchain of " << stageN << " continuations, ns per stage\n" << fixed << setprecision(0);
+  cout << setw(24) << "std::async + get()" << setw(10) << nsPerStage([stageN]() {
+    int value = 0;
+    for (int i=0; i<stageN; ++i)
+      value = std::async(std::launch::async, [value]() { return value + 1; }).get();
+    return value;
+  }) << '\n';
+  cout << setw(24) << "then() inline" << setw(10) << nsPerStage([stageN]() {
+    Promise<int> start;
+    Future<int> value = start.get_future();
+    for (int i=0; i<stageN; ++i)
+      value = value.then([](int v) { return v + 1; });
+    start.set_value(0);
+    return value.get();
+  }) << '\n';
+  cout << setw(24) << "then() on pool" << setw(10) << nsPerStage([stageN, &pool]() {
+    Promise<int> start;
+    Future<int> value = start.get_future();
+    for (int i=0; i<stageN; ++i)
+      value = value.then(pool, [](int v) { return v + 1; });
+    start.set_value(0);
+    return value.get();
+  }) << '\n';
+  cout.unsetf(ios::floatfield);
+
+  // fan out & in
+  vector<Future<int>> squares;
+  for (int i=1; i<=4; ++i)
+    squares.push_back(asyncOn(pool, [i]() { return i * i; }));
+  cout << "when_all sum of squares 1..4 = " << when_all(std::move(squares)).then([](vector<int> values) {
+    return accumulate(values.begin(), values.end(), 0);
+  }).get() << '\n';
+  vector<Future<int>> racers;
+  for (int i=1; i<=4; ++i)
+    racers.push_back(asyncOn(pool, [i]() { this_thread::sleep_for(chrono::milliseconds(10 * i)); return i; }));
+  cout << "when_any winner = racer " << when_any(std::move(racers)).get().second << '\n';
+}
+
+// serial std:: algorithms vs their parallel.h counterparts on 10M elements,
+// with pools of 1, 2, 4, ... up to as many threads as there are cores
+void benchmarkParallelAlgorithms() {
+  const size_t n = 10 * 1000 * 1000;
+  vector<double> input(n), output(n);
+  vector<int> unsorted(n), sorted;
+  mt19937 random(42);
+  for (size_t i=0; i<n; ++i) {
+    input[i] = static_cast<double>(i);
+    unsorted[i] = static_cast<int>(random());
+  }
+  vector<int> expectedSorted(unsorted);
+  sort(expectedSorted.begin(), expectedSorted.end());
+  const double expectedSum = accumulate(input.begin(), input.end(), 0.0);
+
+  auto timeMs = [](function<void()> f) {
+    auto t0 = chrono::steady_clock::now();
+    f();
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+  };
+  auto check = [](bool ok, const char* what) {
+    if (!ok)
+      throw runtime_error(string("benchmarkParallelAlgorithms: wrong ") + what);
+  };
+  auto printRow = [](const string& name, double forMs, double transformMs, double reduceMs, double sortMs) {
+    cout << setw(8) << name << fixed << setprecision(1) << setw(10) << forMs << setw(10) << transformMs
+         << setw(10) << reduceMs << setw(10) << sortMs << '\n';
+    cout.unsetf(ios::floatfield);
+  };
+
+  cout << "\nalgorithms on " << n / 1000000 << "M elements in ms\n";
+  cout << setw(8) << "threads" << setw(10) << "for" << setw(10) << "transform" << setw(10) << "reduce" << setw(10) << "sort" << '\n';
+  {
+    double forMs = timeMs([&]() {
+      for (size_t i=0; i<n; ++i)
+        output[i] = input[i] * 0.5;
+    });
+    double transformMs = timeMs([&]() {
+      transform(input.begin(), input.end(), output.begin(), [](double x) { return sqrt(x); });
+    });
+    double sum = 0;
+    double reduceMs = timeMs([&]() { sum = accumulate(input.begin(), input.end(), 0.0); });
+    sorted = unsorted;
+    double sortMs = timeMs([&]() { sort(sorted.begin(), sorted.end()); });
+    check(sum == expectedSum, "sum");
+    printRow("serial", forMs, transformMs, reduceMs, sortMs);
+  }
+
+  const size_t coreN = max(1u, thread::hardware_concurrency());
+  vector<size_t> threadNs;
+  for (size_t threadN = 1; threadN < coreN; threadN *= 2)
+    threadNs.push_back(threadN);
+  threadNs.push_back(coreN);
+  for (size_t threadN : threadNs) {
+    ThreadPool pool(threadN);
+    double forMs = timeMs([&]() {
+      parallel_for(0, n, [&](size_t i) { output[i] = input[i] * 0.5; }, 0, pool);
+    });
+    check(output[n - 1] == input[n - 1] * 0.5, "parallel_for result");
+    double transformMs = timeMs([&]() {
+      parallel_transform(input.begin(), input.end(), output.begin(), [](double x) { return sqrt(x); }, 0, pool);
+    });
+    check(output[n - 1] == sqrt(input[n - 1]), "parallel_transform result");
+    double sum = 0;
+    double reduceMs = timeMs([&]() { sum = parallel_reduce(input.begin(), input.end(), 0.0, plus<double>(), 0, pool); });
+    check(sum == expectedSum, "sum"); // exact since all partial sums are integers < 2^53
+    sorted = unsorted;
+    double sortMs = timeMs([&]() { parallel_sort(sorted.begin(), sorted.end(), less<int>(), 0, pool); });
+    check(sorted == expectedSorted, "parallel_sort result");
+    printRow(to_string(threadN), forMs, transformMs, reduceMs, sortMs);
+  }
+}
+
 void play_with_threading() {
   {
     vector<thread> threads;
@@ -64,6 +735,16 @@ void play_with_threading() {
     std::for_each(threads.begin(), threads.end(), [](thread& t) { t.join(); });
   }
 
+  // same without a thread per call
+  {
+    ThreadPool pool(2);
+    vector<future<void>> results;
+    for (int i=0; i<5; ++i)
+      results.push_back(pool.submit([i]() { threadFunc(i); }));
+    for (auto& result : results)
+      result.get();
+  }
+
   {
     ProducerConsumer producerConsumer;
     thread prod([&]() { producerConsumer.produce(5); });
@@ -73,4 +754,31 @@ void play_with_threading() {
     con1.join();
     con2.join();
   }
+
+  // same as above via the lock-free queue, which hands items out FIFO
+  {
+    BlockingMpmcQueue<int> queue(4);
+    thread prod([&]() {
+      for (int i=0; i<5; ++i)
+        queue.push(i);
+    });
+    thread con([&]() {
+      for (int i=0; i<5; ++i) {
+        logger.log("mpmc consumer thread consumed item={}", queue.pop());
+      }
+    });
+    prod.join();
+    con.join();
+  }
+
+  logger.flush(); // before the benchmarks write to cout directly
+  benchmarkLogging();
+  benchmarkQueues();
+  benchmarkMutexes();
+  benchmarkHandOffLatency();
+  benchmarkBatching();
+  benchmarkBackpressure();
+  benchmarkWorkStealing();
+  benchmarkContinuations();
+  benchmarkParallelAlgorithms();
 }